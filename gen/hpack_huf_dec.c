@@ -29,218 +29,153 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>
+#include <stdlib.h>
 
 #include "gen.h"
 
+/* NB: The lookup table decodes up to two symbols out of LUT_BITS bits, which
+ * covers all codes found in common header fields. Longer codes are decoded
+ * with the canonical properties of the HPACK Huffman code: for a given
+ * length, codes are consecutive and sorted like their symbols.
+ */
+#define LUT_BITS	11
+#define MAX_BITS	30
+#define EOS_SYM		256
+
 struct hph {
 	uint32_t	cod; /* the original huffman code */
-	uint32_t	msb; /* code bits aligned left */
 	uint16_t	len; /* number of bits in the code */
-	uint8_t		chr;
-};
-
-struct hph_dec {
-	uint8_t		len;
-	uint8_t		chr;
-	char		nxt[sizeof "&hph_octX_pfxYYYY"];
+	uint16_t	sym;
 };
 
-static const struct hph tbl[] = {
-#define HPH(c, h, l) { h, (uint32_t)h << (32 - l), l, c },
+static struct hph tbl[] = {
+#define HPH(c, h, l) { h, l, c },
 #include "tbl/hpack_huffman.h"
 #undef HPH
-	{0, 0, 33, 0} /* EOS */
+	{ 0x3fffffff, 30, EOS_SYM }
 };
 
-static const struct hph *eos = &tbl[256];
-
-static void dec_generate(const struct hph *, const struct hph *, uint32_t,
-    int, int, const char *);
+#define TBL_LEN	(sizeof tbl / sizeof *tbl)
 
 static int
-dec_rndpow2(int i, int rnd)
+dec_cmp(const void *a, const void *b)
 {
+	const struct hph *ha, *hb;
 
-	while ((i & (i - 1)) != 0)
-		i += rnd;
-	return (i);
+	ha = a;
+	hb = b;
+	if (ha->len != hb->len)
+		return (ha->len - hb->len);
+	return (ha->cod < hb->cod ? -1 : ha->cod > hb->cod);
 }
 
-static int
-dec_bits(int i)
+static const struct hph *
+dec_match(uint32_t bits, unsigned avail)
 {
-	int r = 0;
-
-	i = dec_rndpow2(i, -1);
-	while (i > 0) {
-		i >>= 1;
-		r++;
-	}
-	return (r);
+	const struct hph *hph;
+	unsigned i;
+
+	/* bits are aligned left */
+	for (i = 0, hph = tbl; i < TBL_LEN && hph->len <= avail; i++, hph++)
+		if ((bits >> (32 - hph->len)) == hph->cod)
+			return (hph);
+	return (NULL);
 }
 
 static void
-dec_pfxcat(char *dst, int ref, int n)
-{
-
-	n = dec_rndpow2(n, +1);
-	assert(n >  0);
-	assert(n <= 4);
-	do {
-		n--;
-		strcat(dst, (ref >> n) & 1 ? "1" : "0");
-	} while (n > 0);
-}
-
-static unsigned
-dec_make_hit(const struct hph *hph, struct hph_dec *dec, unsigned n,
-    uint32_t msk, int msk_len, int oct)
-{
-	uint32_t msb;
-
-	msb = (uint32_t)(n << (32 - msk_len)) | msk;
-	if ((msb >> (32 - hph->len)) != hph->cod)
-		return (0);
-
-	dec[n].len = (uint8_t)(hph->len - oct * 8);
-	dec[n].chr = hph->chr;
-	(void)snprintf(dec[n].nxt, sizeof dec->nxt, "NULL");
-	return (1);
-}
-
-static unsigned
-dec_make_misses(const struct hph *hph, struct hph_dec *dec, int n, int oct)
+dec_lut(void)
 {
-	const struct hph *max;
-	char buf[sizeof "_pfxXXXX"];
-	uint32_t msk, sub_msk;
-	int sz, msk_len, sub_tbl, bits, ref;
-
-	sz = dec_rndpow2(n, +1);
-	sub_tbl = sz - n;
-	assert(sub_tbl <= 10);
-
-	bits = dec_bits(sub_tbl);
-	sub_msk = (1 << bits) - 1;
-
-	ref = (int)(1 + sub_msk - (unsigned)sub_tbl);
-	while (n < sz) {
-		assert(n < 256);
-		dec[n].len = 8;
-		dec[n].chr = 0;
-
-		if (oct == 4) {
-			dec[n].len = 0;
-			(void)sprintf(dec[n].nxt, "NULL");
-			break;
-		}
-		else {
-			(void)sprintf(buf, "_pfx");
-			dec_pfxcat(buf, ref, bits - 1);
-			(void)sprintf(dec[n].nxt, "&hph_dec%d%s", oct, buf);
-		}
+	const struct hph *fst, *snd;
+	uint32_t bits;
+	unsigned n, len0, len1;
+	uint8_t chr0, chr1;
 
-		if (n == 0xff) {
-			/* start the next full octet */
-			msk_len = 8 * (oct + 1);
-			assert(msk_len > hph->len);
-			msk = 0xffffffff << (40 - msk_len);
-			max = eos;
-			if (msk_len > 30)
-				msk_len = 30;
+	OUT("");
+	OUT("static const struct hph_lut hph_lut[] = {");
+	for (n = 0; n < 1U << LUT_BITS; n++) {
+		bits = n << (32 - LUT_BITS);
+		fst = dec_match(bits, LUT_BITS);
+		if (fst == NULL) {
+			GEN("\t/* 0x%03x */ {0, {0, 0}, {0x00, 0x00}},", n);
+			continue;
 		}
-		else {
-			/* help finish the next octect */
-			msk_len = 8 * oct;
-			msk = 0xffffffff << (32 - msk_len);
-			msk |= (unsigned)ref << (32 - msk_len + bits);
-
-			max = hph;
-			while ((max->msb & msk) == (hph->msb & msk)) {
-				msk_len = max->len;
-				max++;
-			}
-			assert(max > hph);
-
-			msk = hph->msb;
+		assert(fst->sym != EOS_SYM);
+		len0 = fst->len;
+		chr0 = (uint8_t)fst->sym;
+		snd = dec_match(bits << len0, LUT_BITS - len0);
+		if (snd == NULL) {
+			GEN("\t/* 0x%03x */ {1, {%u, %u}, {(char)0x%02x, 0x00}},",
+			    n, len0, len0, chr0);
+			continue;
 		}
-
-		assert(max > hph);
-		dec_generate(hph, max, msk, msk_len, oct, buf);
-		hph = max;
-
-		ref++;
-		n++;
+		assert(snd->sym != EOS_SYM);
+		len1 = len0 + snd->len;
+		chr1 = (uint8_t)snd->sym;
+		GEN("\t/* 0x%03x */ {2, {%u, %u}, {(char)0x%02x, (char)0x%02x}},",
+		    n, len0, len1, chr0, chr1);
 	}
-	assert(dec_rndpow2(ref, +1) == ref);
-
-	assert(sz > 0);
-	return ((unsigned)sz);
+	OUT("};");
 }
 
 static void
-dec_generate(const struct hph *hph, const struct hph *max, uint32_t msk,
-    int msk_len, int oct, const char *pfx)
+dec_canonical(void)
 {
-	struct hph_dec dec[256];
-	unsigned n, sz, len;
-
-	n = 0;
-	while (hph != max && hph->len <= msk_len) {
-		assert(n < 256);
-		if (!dec_make_hit(hph, dec, n, msk, msk_len, oct)) {
-			assert(n > 0);
-			hph++;
-			continue;
-		}
-		n++;
+	uint32_t fst[MAX_BITS + 1];
+	unsigned cnt[MAX_BITS + 1], off[MAX_BITS + 1];
+	unsigned i, l;
+
+	for (l = 0; l <= MAX_BITS; l++) {
+		fst[l] = 0;
+		cnt[l] = 0;
+		off[l] = 0;
 	}
-	assert(n > 0);
 
-	if (max == eos)
-		sz = dec_make_misses(hph, dec, (int)n, oct + 1);
-	else {
-		assert(hph == max);
-		sz = n;
+	for (i = TBL_LEN; i > 0; i--) {
+		l = tbl[i - 1].len;
+		assert(l <= MAX_BITS);
+		fst[l] = tbl[i - 1].cod;
+		off[l] = i - 1;
+		cnt[l]++;
 	}
 
-	n = sz - 1;
-	if (dec[n].len == 0)
-		n--;
-	len = dec[n].len;
-	assert(len > 0);
-
 	OUT("");
-	GEN("static const struct hph_oct hph_oct%d%s[] = {", oct, pfx);
-	for (n = 0; n < sz; n++)
-		GEN("\t/* 0x%02x */ {%d, (char)0x%02x, %s},",
-		    n, dec[n].len, dec[n].chr, dec[n].nxt);
+	OUT("static const struct hph_len hph_len[] = {");
+	for (l = 0; l <= MAX_BITS; l++)
+		GEN("\t/* %2u */ {0x%08x, %3u, %3u},", l, fst[l], cnt[l], off[l]);
 	OUT("};");
+
 	OUT("");
-	GEN("static const struct hph_dec hph_dec%d%s = {%u, hph_oct%d%s};",
-	    oct, pfx, len, oct, pfx);
+	OUT("static const uint16_t hph_sym[] = {");
+	for (i = 0; i < TBL_LEN; i++)
+		GEN("\t/* %3u */ 0x%03x,", i, tbl[i].sym);
+	OUT("};");
 }
 
 int
 main(void)
 {
 
+	qsort(tbl, TBL_LEN, sizeof *tbl, dec_cmp);
+
 	GEN_HDR();
-	OUT("struct hph_oct;");
+	GEN("#define HPH_LUT_BITS\t%d", LUT_BITS);
+	GEN("#define HPH_MAX_BITS\t%d", MAX_BITS);
+	GEN("#define HPH_EOS\t\t%d", EOS_SYM);
 	OUT("");
-	OUT("struct hph_dec {");
-	OUT("\tuint8_t\t\t\tlen;");
-	OUT("\tconst struct hph_oct\t*oct;");
+	OUT("struct hph_lut {");
+	OUT("\tuint8_t\t\tcnt;");
+	OUT("\tuint8_t\t\tlen[2];");
+	OUT("\tchar\t\tchr[2];");
 	OUT("};");
 	OUT("");
-	OUT("struct hph_oct {");
-	OUT("\tuint8_t\t\t\tlen;");
-	OUT("\tchar\t\t\tchr;");
-	OUT("\tconst struct hph_dec\t*nxt;");
+	OUT("struct hph_len {");
+	OUT("\tuint32_t\tfst;");
+	OUT("\tuint16_t\tcnt;");
+	OUT("\tuint16_t\toff;");
 	OUT("};");
 
-	dec_generate(tbl, eos, 0x00000000, 8, 0, "");
+	dec_lut();
+	dec_canonical();
 
 	return (0);
 }
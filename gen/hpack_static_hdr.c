@@ -26,6 +26,7 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,13 +35,17 @@
 
 #define HDR_LEN 61
 
+#define HDR_HASH(a, b, nam, len, msk)				\
+	(((a) * (uint8_t)(nam)[0] + (b) * (uint8_t)(nam)[(len) - 1] +	\
+	    (len)) & (msk))
+
 struct hdr {
 	const char	*nam;
 	const char	*val;
 	size_t		idx;
 };
 
-static struct hdr static_tbl[HDR_LEN + 1] = {
+static const struct hdr static_tbl[HDR_LEN + 1] = {
 #define HPS(i, n, v)				\
 	{					\
 		.nam = n,			\
@@ -52,45 +57,78 @@ static struct hdr static_tbl[HDR_LEN + 1] = {
 	{ NULL, NULL, 0 }
 };
 
+static unsigned bkt_idx[256];
+static unsigned bkt_cnt[256];
+
 static int
-hdr_cmp(const void *v1, const void *v2)
+hdr_hash(unsigned a, unsigned b, unsigned msk)
 {
-	const struct hdr *h1, *h2;
+	const struct hdr *fld;
+	size_t len;
+	unsigned h;
 
-	/* NB: there is no need to also compare values in this case because
-	 * only pseudo-headers may collide on names in the static table.
-	 */
-	h1 = v1;
-	h2 = v2;
-	return (strcmp(h1->nam, h2->nam));
+	(void)memset(bkt_idx, 0, sizeof bkt_idx);
+	(void)memset(bkt_cnt, 0, sizeof bkt_cnt);
+
+	for (fld = static_tbl; fld->nam != NULL; fld++) {
+		len = strlen(fld->nam);
+		h = HDR_HASH(a, b, fld->nam, len, msk);
+		if (bkt_idx[h] == 0)
+			bkt_idx[h] = fld->idx;
+		else if (strcmp(static_tbl[bkt_idx[h] - 1].nam, fld->nam))
+			return (-1);
+		else if (bkt_idx[h] + bkt_cnt[h] != fld->idx)
+			return (-1); /* entries must be contiguous */
+		bkt_cnt[h]++;
+	}
+
+	return (0);
+}
+
+static int
+hdr_perfect(unsigned *ap, unsigned *bp, unsigned msk)
+{
+	unsigned a, b;
+
+	for (a = 1; a < 256; a++)
+		for (b = 1; b < 256; b++)
+			if (hdr_hash(a, b, msk) == 0) {
+				*ap = a;
+				*bp = b;
+				return (0);
+			}
+
+	return (-1);
 }
 
 int
 main(void)
 {
-	const struct hdr *fld;
-	unsigned n;
-
-	qsort(static_tbl, HDR_LEN, sizeof static_tbl[0], hdr_cmp);
+	unsigned a, b, msk;
 
-	n = 0;
-	fld = static_tbl;
-	while (*fld->nam == ':') {
-		fld++;
-		n++;
+	/* NB: Look for the smallest table where the first and last bytes
+	 * of the name and its length are enough to tell all the names of
+	 * the static table apart. Entries sharing a name are contiguous,
+	 * so a bucket only needs the first index and the number of entries.
+	 */
+	msk = 63;
+	while (hdr_perfect(&a, &b, msk) != 0) {
+		msk = msk * 2 + 1;
+		if (msk > 255) {
+			fprintf(stderr, "no perfect hash for the static table\n");
+			return (EXIT_FAILURE);
+		}
 	}
 
 	GEN_HDR();
-	GEN("#define HPS_PSEUDO %u", n);
-	GEN("#define HPS_NORMAL %u", HDR_LEN - n);
+	GEN("#define HPS_HASH(nam, len)\t\t\t\t\t\t\\\n"
+	    "\t((%uu * (uint8_t)(nam)[0] + %uu * (uint8_t)(nam)[(len) - 1] +\t\\\n"
+	    "\t    (len)) & %uu)", a, b, msk);
 	OUT("");
-	OUT("static const struct hpt_field hpack_static_hdr[] = {");
-	while (fld->nam != NULL) {
-		GEN("\t{ \"%s\", \"%s\", %zu, %zu, %zu },",
-		    fld->nam, fld->val, strlen(fld->nam), strlen(fld->val),
-		    fld->idx);
-		fld++;
-	}
+	GEN("static const uint8_t hpack_static_hash[%u][2] = {", msk + 1);
+	for (a = 0; a <= msk; a++)
+		if (bkt_idx[a] != 0)
+			GEN("\t[%u] = { %u, %u },", a, bkt_idx[a], bkt_cnt[a]);
 	OUT("};");
 
 	return (0);
@@ -53,6 +53,9 @@
 #define HPT_FLG_STATIC	0x01
 #define HPT_FLG_DYNAMIC	0x02
 
+#define HPV_CLS_TOK	0x01
+#define HPV_CLS_VAL	0x02
+
 /**********************************************************************
  * Data Structures
  */
@@ -89,10 +92,9 @@ struct hpt_entry {
 	uint32_t	magic;
 #define HPT_ENTRY_MAGIC	0xe4582b39
 	uint32_t	align; /* fill a hole on 64-bit systems */
-	uint64_t	pre_sz;
 	uint16_t	nam_sz;
 	uint16_t	val_sz;
-	uint16_t	pad[5];
+	uint16_t	pad[9];
 	/* NB: The last two bytes are never written nor read. They are here
 	 * only to guarantee that this struct size is exactly 32 bytes, the
 	 * per-entry overhead defined in RFC 7541 section 4.1.
@@ -100,8 +102,79 @@ struct hpt_entry {
 	uint16_t	unused;
 };
 
+struct hpd_segment {
+	uint32_t		magic;
+#define HPD_SEGMENT_MAGIC	0x5e6d2a17
+	struct hpd_segment	*nxt;
+	size_t			len;
+	char			buf[];
+};
+
+struct hph_state {
+	const char	*str;
+	size_t		len;
+	uint64_t	bits;
+	size_t		sz; /* of pending bits */
+};
+
+#define HPH_CACHE_SLOTS	8
+#define HPH_CACHE_MIN	16
+
+struct hph_entry {
+	size_t		raw_sz;
+	size_t		val_sz;
+	uint8_t		cls;
+};
+
+struct hph_cache {
+	uint32_t		magic;
+#define HPH_CACHE_MAGIC		0x48c4ce5a
+	unsigned		nxt;
+	size_t			len; /* of a slot */
+	struct hph_entry	ent[HPH_CACHE_SLOTS];
+	char			buf[];
+};
+
+struct hpe_value {
+	uint32_t	key;
+	uint32_t	off; /* of the value, followed by its encoding */
+	uint16_t	val_sz;
+	uint16_t	enc_sz;
+	uint8_t		huf;
+};
+
+struct hpack_preset {
+	uint32_t		magic;
+#define PRESET_MAGIC		0x9a5e7c31
+	struct hpack_alloc	alloc;
+	size_t			msk;
+	struct hpe_value	val[];
+};
+
+struct hpack_template {
+	uint32_t		magic;
+#define TEMPLATE_MAGIC		0x7e3a1c55
+	struct hpack_alloc	alloc;
+	uint64_t		ins;
+	size_t			dep; /* oldest dynamic entry referenced */
+	size_t			dyn; /* fields left to insert */
+	size_t			fix; /* fields always inserted */
+	unsigned		stk; /* no progress from the last compilation */
+	uint64_t		stk_ins;
+	struct hpack_field	*fld;
+	struct hpack_field	*cpy; /* for the fallback */
+	size_t			fld_cnt;
+	uint8_t			*blk;
+	size_t			blk_len;
+	size_t			blk_sz;
+};
+
 #define HPACK_CTX_CAN_UPD (unsigned)1
 #define HPACK_CTX_TOO_BIG (unsigned)2
+#define HPACK_CTX_REF     (unsigned)4
+#define HPACK_CTX_STM     (unsigned)8
+#define HPACK_CTX_DSC     (unsigned)16
+#define HPACK_CTX_RAW     (unsigned)32
 
 struct hpack_ctx {
 	struct hpack				*hp;
@@ -124,6 +197,11 @@ struct hpack_ctx {
 	} fld;
 	hpack_event_f				*cb;
 	void					*priv;
+	struct hpack_field			*lst;
+	size_t					lst_len;
+	size_t					lst_cnt;
+	struct hpd_segment			*seg;
+	unsigned				ign;
 	enum hpack_result_e			res;
 	unsigned				flg;
 };
@@ -164,17 +242,61 @@ struct hpack_size {
 	ssize_t			min;
 };
 
+struct hpack_ring {
+	/* NB: The dynamic table is a ring buffer of contiguous entries. The
+	 * oldest entry starts at the bgn offset and the end offset is right
+	 * after the newest entry. When an entry doesn't fit before the end
+	 * of the buffer, the ring wraps around and wrp marks the end of the
+	 * oldest entries. Otherwise wrp is zero.
+	 */
+	size_t			bgn;
+	size_t			end;
+	size_t			wrp;
+};
+
+struct hpack_dir {
+	/* NB: The directory keeps track of the entries of the ring buffer,
+	 * so that a lookup doesn't need to walk the table. Each array holds
+	 * one slot per entry, the oldest entry being in the bgn slot. The
+	 * arrays live right after the ring buffer, in the same allocation,
+	 * and cap is the number of slots needed for the smallest entries to
+	 * fill the whole ring.
+	 *
+	 * Entries are also indexed by the hash of their name, and the hash
+	 * of both their name and value. A bucket refers to the newest entry
+	 * with a given hash modulo cap, and each entry to the next older
+	 * one in the same bucket. References are slot numbers plus one, and
+	 * evictions don't update them: a reference to a slot that is not
+	 * older than the one it was reached from ends the chain.
+	 */
+	uint32_t		*nam_hsh;
+	uint32_t		*fld_hsh;
+	uint16_t		*off;
+	uint16_t		*nam_sz;
+	uint16_t		*val_sz;
+	uint16_t		*nam_nxt;
+	uint16_t		*fld_nxt;
+	uint16_t		*nam_bkt;
+	uint16_t		*fld_bkt;
+	size_t			cap;
+	size_t			bgn;
+};
+
+#define HPT_SLOTS(mem)	((mem) / (HPACK_OVERHEAD + 1) + 1)
+#define HPT_SLOTSZ	(2 * sizeof(uint32_t) + 7 * sizeof(uint16_t))
+#define HPT_DIROFF(mem)	(((mem) + 7) & ~(size_t)7)
+#define HPT_MEMSZ(mem)	(HPT_DIROFF(mem) + HPT_SLOTS(mem) * HPT_SLOTSZ)
+
 struct hpack_int_state {
 	uint16_t	v;
 	uint8_t		m;
 };
 
 struct hpack_str_state {
-	const struct hph_dec	*dec;
-	const struct hph_oct	*oct;
-	uint16_t		len;
-	uint16_t		bits;
-	uint8_t			blen;
+	uint64_t	bits;
+	uint16_t	len;
+	uint8_t		blen;
+	uint8_t		cls;
 };
 
 struct hpack_state {
@@ -186,12 +308,29 @@ struct hpack_state {
 	int					bsy;
 	uint16_t				idx;
 	uint8_t					typ;
+	uint8_t					huf;
 	union {
 		struct hpack_int_state		hpi;
 		struct hpack_str_state		str;
 	} stt;
 };
 
+struct hpt_name {
+	const char	*nam;
+	size_t		len;
+	uint32_t	hsh;
+	uint32_t	nxt; /* next name in the bucket, plus one */
+};
+
+struct hpack_select {
+	uint32_t		magic;
+#define HPT_SELECT_MAGIC	0x5e1ec7ed
+	uint64_t		msk; /* static names of interest */
+	size_t			cnt;
+	uint32_t		*bkt; /* of cnt buckets */
+	struct hpt_name		nam[];
+};
+
 struct hpack {
 	uint32_t		magic;
 #define ENCODER_MAGIC		0x8ab1fb4c
@@ -201,6 +340,11 @@ struct hpack {
 	struct hpack_size	sz;
 	struct hpack_state	state;
 	size_t			cnt; /* number of entries in the table */
+	uint64_t		ins; /* number of insertions so far */
+	struct hpack_ring	rng;
+	struct hpack_dir	dir;
+	struct hph_cache	*cch;
+	struct hpack_select	*sel;
 	struct hpack_ctx	ctx;
 	struct hpt_entry	tbl[];
 };
@@ -211,31 +355,59 @@ typedef int hpack_validate_f(HPACK_CTX, const char *, size_t);
  * Function Signatures
  */
 
-void HPC_notify(HPACK_CTX, enum hpack_event_e, const void *, size_t);
+void HPC_event(HPACK_CTX, enum hpack_event_e, const void *, size_t);
+
+/* NB: Ignored events are filtered before the call, without evaluating
+ * the other arguments.
+ */
+#define HPC_notify(ctx, evt, buf, len)				\
+	do {							\
+		if (((ctx)->ign & (1U << (evt))) == 0)		\
+			HPC_event(ctx, evt, buf, len);		\
+	} while (0)
 
 int  HPD_putc(HPACK_CTX, char);
 int  HPD_puts(HPACK_CTX, const char *, size_t);
 int  HPD_cat(HPACK_CTX, const char *, size_t);
+int  HPD_copy(HPACK_CTX, struct hpack_str_state *, const char *, size_t);
 void HPD_notify(HPACK_CTX);
+void HPD_data(HPACK_CTX, const char *, size_t);
+void HPD_release(HPACK_CTX);
 
 void HPE_putb(HPACK_CTX, uint8_t);
+void HPE_putw(HPACK_CTX, uint32_t);
 void HPE_bcat(HPACK_CTX, const void *, size_t);
 void HPE_send(HPACK_CTX);
 
-int  HPI_decode(HPACK_CTX, enum hpi_prefix_e, uint16_t *);
-void HPI_encode(HPACK_CTX, enum hpi_prefix_e, enum hpi_pattern_e, uint16_t);
+int    HPI_decode(HPACK_CTX, enum hpi_prefix_e, uint16_t *);
+void   HPI_encode(HPACK_CTX, enum hpi_prefix_e, enum hpi_pattern_e, uint16_t);
+size_t HPI_size(enum hpi_prefix_e, uint16_t);
+
+int    HPH_decode(HPACK_CTX, struct hpack_str_state *, size_t);
+int    HPH_decode_cached(HPACK_CTX, struct hpack_str_state *, size_t);
+void   HPH_encode(HPACK_CTX, const char *, size_t);
+size_t HPH_fill(struct hph_state *, uint8_t *, size_t);
+void   HPH_resume(HPACK_CTX, struct hph_state *);
+size_t HPH_pending(const struct hph_state *);
+size_t HPH_size(const char *, size_t);
+size_t HPH_shrink(const char *, size_t);
 
-int    HPH_decode(HPACK_CTX, size_t);
-void   HPH_encode(HPACK_CTX, const char *);
-size_t HPH_size(const char *);
+extern const uint8_t HPV_cls[256];
 
 hpack_validate_f HPV_token;
 hpack_validate_f HPV_value;
+uint8_t HPV_class(uint8_t, const char *, size_t);
+int HPV_name(HPACK_CTX, const char *, size_t, uint8_t);
 
 void HPT_adjust(HPACK_CTX, size_t);
+void HPT_compact(HPACK_CTX);
+void HPT_rebuild(HPACK_CTX);
 int  HPT_field(HPACK_CTX, size_t, struct hpt_field *);
 void HPT_foreach(HPACK_CTX, int);
 int  HPT_search(HPACK_CTX, struct hpt_field *);
 int  HPT_decode(HPACK_CTX, size_t);
 int  HPT_decode_name(HPACK_CTX);
+struct hpack_select * HPT_select(const struct hpack_alloc *,
+    const char * const *, size_t);
+unsigned HPT_selected(HPACK_CTX);
 void HPT_index(HPACK_CTX);
@@ -1,11 +0,0 @@
-/*-
- * Written by Dridi Boukelmoune <dridi.boukelmoune@gmail.com>
- *
- * This file is in the public domain.
- */
-
-HPPH(":authority")
-HPPH(":method")
-HPPH(":path")
-HPPH(":scheme")
-HPPH(":status")
@@ -147,12 +147,12 @@ HPE(NAME,  3, "field name",
 	"\tA decoder sends a NAME event when the current field's name has\n"
 	"\tbeen or will be decoded. When *buf* is not ``NULL``, it points\n"
 	"\tto the *len* characters of the name string. The string is NOT\n"
-	"\tnull-terminated. A ``NULL`` *buf* means that there are *len*\n"
-	"\tHuffman octets to decode, or that the HPACK block expects a\n"
-	"\tcontinuation in the middle of this string. In the worst case,\n"
-	"\tthe decoded string length is ``1.6 * len`` and can be used as a\n"
-	"\tbaseline for a preallocation. When *buf* is ``NULL`` the decoded\n"
-	"\tcontents will be notified by at least one DATA event.\n\n"
+	"\tnull-terminated. A ``NULL`` *buf* means that the string is\n"
+	"\tstreamed and that there are *len* octets to decode, possibly\n"
+	"\tHuffman-encoded. In the worst case, the decoded string length is\n"
+	"\t``1.6 * len`` and can be used as a baseline for a preallocation.\n"
+	"\tWhen *buf* is ``NULL`` the decoded contents will be notified by\n"
+	"\tDATA events, possibly spanning partial blocks.\n\n"
 
 	"\tWhen the contents of the dynamic table are listed, exactly one\n"
 	"\tNAME event follows a FIELD event. The *buf* argument points to\n"
@@ -161,14 +161,20 @@ HPE(NAME,  3, "field name",
 HPE(VALUE, 4, "field Value",
 	"\tThe VALUE event is identical to the NAME event, and always comes\n"
 	"\tafter the NAME event of a field. Instead of referring to the\n"
-	"\tfield's name, it signals its value.\n\n")
+	"\tfield's name, it signals its value. Only values are streamed,\n"
+	"\twhen the decoder is asked to and the value may not fit in the\n"
+	"\tdecoding buffer.\n\n")
 
 HPE(DATA,  5, "raw data",
 	"\tAn encoder sends DATA events when the encoding buffer is full,\n"
 	"\tor when the encoding process is over and there are remaining\n"
 	"\toctets.\n\n"
 
-	"\tIn both cases *buf* points to *len* octets of data.\n\n")
+	"\tA decoder sends DATA events after a VALUE event with a ``NULL``\n"
+	"\t*buf*, with the decoded contents of the value. The value ends\n"
+	"\twith the next field or the end of the header list.\n\n"
+
+	"\tIn all cases *buf* points to *len* octets of data.\n\n")
 
 HPE(EVICT, 6, "fields were evicted",
 	"\tA decoder or an encoder sends an EVICT event to notify that some\n"
@@ -183,6 +189,16 @@ HPE(TABLE, 7, "the table was updated",
 	"\tA decoder or an encoder sends a TABLE event when a dynamic table\n"
 	"\tupdate is decoded or encoded. The *buf* argument is always\n"
 	"\t``NULL`` and *len* is the new table maximum size.\n\n")
+
+HPE(RAW,   8, "raw value",
+	"\tA decoder sends RAW events instead of a VALUE event when the\n"
+	"\tname of a field that is not indexed is not part of the interest\n"
+	"\tset, or when its Huffman value is decoded lazily. The *buf*\n"
+	"\targument points to *len* octets of the value as it appears in\n"
+	"\tthe HPACK block, including its length prefix and Huffman flag,\n"
+	"\tand it is neither decoded nor validated. A value that spans\n"
+	"\tpartial blocks is sent in several RAW events. A complete value\n"
+	"\tcan be decoded with ``hpack_decode_value()``.\n\n")
 #endif /* HPE */
 
 #ifdef HPF
@@ -227,6 +243,32 @@ HPF(AUT_IDX, 0x80,
 	"\tname and value) is found, either ``TYP_DYN`` or ``TYP_LIT`` are\n"
 	"\tturned into ``TYP_IDX``. If a match is found, *idx* or *nam_idx*\n"
 	"\tis set to non-zero, zero otherwise.\n\n")
+
+HPF(STR_LEN, 0x100,
+	"\tThe members *nam_len* and *val_len* are the lengths of the name\n"
+	"\tand value strings, which then don't need to be null-terminated.\n"
+	"\tWithout this flag, the lengths are computed with ``strlen()``.\n"
+	"\tIt can be used for any type of field except ``TYP_IDX``, and\n"
+	"\t*nam_len* is ignored with ``NAM_IDX``.\n\n")
+
+HPF(NAM_AUT, 0x200,
+	"\tAutomatically Huffman-encode the name string, only when it makes\n"
+	"\tit shorter. It supersedes ``NAM_HUF``, and can be used for any\n"
+	"\ttype of field except ``TYP_IDX`` or fields with ``NAM_IDX``.\n\n")
+
+HPF(VAL_AUT, 0x400,
+	"\tAutomatically Huffman-encode the value string, only when it makes\n"
+	"\tit shorter. It supersedes ``VAL_HUF``, and can be used for any\n"
+	"\ttype of field except ``TYP_IDX``.\n\n")
+
+HPF(VAL_PRE, 0x800,
+	"\tThe member *val* points to a value pre-encoded with\n"
+	"\t``hpack_precode_value()``, and its representation is copied as\n"
+	"\tis. The pre-encoded value starts with the plain value, so its\n"
+	"\tlength is still computed with ``strlen()`` and *val_len* is still\n"
+	"\tthe length of the plain value with ``STR_LEN``. It supersedes\n"
+	"\t``VAL_HUF`` and ``VAL_AUT`` for the value, and can be used for any\n"
+	"\ttype of field except ``TYP_IDX``.\n\n")
 #endif /* HPF */
 
 #ifdef HPP
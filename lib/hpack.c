@@ -45,6 +45,9 @@
 #define FUNC_PTR(f)	(const void *)(const uint8_t *)&(f)
 #define HPACK_FLG(f)	((unsigned)HPACK_FLG_##f)
 
+#define HPACK_PRE_MARK	0xc5
+#define HPACK_PRE_HDR	3 /* marker and plain length */
+
 /**********************************************************************
  * System allocator
  */
@@ -98,7 +101,7 @@ hpack_new(uint32_t magic, size_t mem, size_t max,
 
 	assert(mem >= max || magic == ENCODER_MAGIC);
 
-	hp = ha->malloc(sizeof *hp + mem, ha->priv);
+	hp = ha->malloc(sizeof *hp + HPT_MEMSZ(mem), ha->priv);
 	if (hp == NULL)
 		return (NULL);
 
@@ -112,6 +115,7 @@ hpack_new(uint32_t magic, size_t mem, size_t max,
 	hp->sz.cap = -1;
 	hp->sz.nxt = -1;
 	hp->sz.min = -1;
+	HPT_rebuild(&hp->ctx);
 	return (hp);
 }
 
@@ -159,12 +163,14 @@ hpack_realloc(struct hpack **hpp, size_t mem)
 	if (hp->alloc.realloc == NULL)
 		return (HPACK_RES_REA);
 
-	hp = hp->alloc.realloc(hp, sizeof *hp + mem, hp->alloc.priv);
+	hp = hp->alloc.realloc(hp, sizeof *hp + HPT_MEMSZ(mem),
+	    hp->alloc.priv);
 	if (hp == NULL)
 		return (HPACK_RES_OOM);
 
 	hp->ctx.hp = hp;
 	hp->sz.mem = mem;
+	HPT_rebuild(&hp->ctx);
 	*hpp = hp;
 	return (HPACK_RES_OK);
 }
@@ -301,16 +307,83 @@ hpack_trim(struct hpack **hpp)
 		max = hp->sz.max;
 
 	if (hp->sz.mem > max) {
-		hp = hp->alloc.realloc(hp, sizeof *hp + max, hp->alloc.priv);
+		HPT_compact(&hp->ctx);
+		hp = hp->alloc.realloc(hp, sizeof *hp + HPT_MEMSZ(max),
+		    hp->alloc.priv);
 		if (hp == NULL)
 			return (HPACK_RES_OOM); /* the codec is NOT defunct */
+		hp->ctx.hp = hp;
 		hp->sz.mem = max;
+		HPT_rebuild(&hp->ctx);
 		*hpp = hp;
 	}
 
 	return (HPACK_RES_OK);
 }
 
+enum hpack_result_e
+hpack_huffman_cache(struct hpack *hp, size_t len)
+{
+	struct hph_cache *hc;
+
+	/* NB: A slot must at least hold the shortest value worth caching,
+	 * and its decoded string.
+	 */
+	if (hp == NULL || hp->magic != DECODER_MAGIC ||
+	    hp->alloc.free == NULL || (len > 0 &&
+	    len < HPH_CACHE_SLOTS * 2 * HPH_CACHE_MIN) ||
+	    len > SIZE_MAX - sizeof *hc)
+		return (HPACK_RES_ARG);
+
+	if (hp->ctx.res != HPACK_RES_OK) {
+		assert(hp->ctx.res == HPACK_RES_BLK);
+		return (HPACK_RES_BSY);
+	}
+
+	hc = NULL;
+	if (len > 0) {
+		hc = hp->alloc.malloc(sizeof *hc + len, hp->alloc.priv);
+		if (hc == NULL)
+			return (HPACK_RES_OOM); /* the codec is NOT defunct */
+		(void)memset(hc, 0, sizeof *hc);
+		hc->magic = HPH_CACHE_MAGIC;
+		hc->len = len / HPH_CACHE_SLOTS;
+	}
+
+	if (hp->cch != NULL)
+		hp->alloc.free(hp->cch, hp->alloc.priv);
+	hp->cch = hc;
+	return (HPACK_RES_OK);
+}
+
+enum hpack_result_e
+hpack_select(struct hpack *hp, const char * const *sel, size_t len)
+{
+	struct hpack_select *hs;
+
+	if (hp == NULL || hp->magic != DECODER_MAGIC ||
+	    hp->alloc.free == NULL || (sel == NULL && len > 0) ||
+	    (sel != NULL && len == 0))
+		return (HPACK_RES_ARG);
+
+	if (hp->ctx.res != HPACK_RES_OK) {
+		assert(hp->ctx.res == HPACK_RES_BLK);
+		return (HPACK_RES_BSY);
+	}
+
+	hs = NULL;
+	if (sel != NULL) {
+		hs = HPT_select(&hp->alloc, sel, len);
+		if (hs == NULL)
+			return (HPACK_RES_OOM); /* the codec is NOT defunct */
+	}
+
+	if (hp->sel != NULL)
+		hp->alloc.free(hp->sel, hp->alloc.priv);
+	hp->sel = hs;
+	return (HPACK_RES_OK);
+}
+
 void
 hpack_free(struct hpack **hpp)
 {
@@ -328,6 +401,15 @@ hpack_free(struct hpack **hpp)
 	    hp->magic != DEFUNCT_MAGIC)
 		return;
 
+	HPD_release(&hp->ctx);
+	if (hp->cch != NULL) {
+		assert(hp->alloc.free != NULL);
+		hp->alloc.free(hp->cch, hp->alloc.priv);
+	}
+	if (hp->sel != NULL) {
+		assert(hp->alloc.free != NULL);
+		hp->alloc.free(hp->sel, hp->alloc.priv);
+	}
 	hp->magic = 0;
 	if (hp->alloc.free != NULL)
 		hp->alloc.free(hp, hp->alloc.priv);
@@ -392,6 +474,7 @@ enum hpack_result_e
 hpack_search(struct hpack *hp, uint16_t *idx, const char *nam, const char *val)
 {
 	struct hpt_field hf;
+	size_t nam_sz, val_sz;
 	int retval;
 
 	if (hp == NULL || idx == NULL || nam == NULL)
@@ -403,6 +486,15 @@ hpack_search(struct hpack *hp, uint16_t *idx, const char *nam, const char *val)
 	hf.val = (val != NULL) ? val : "";
 	hf.idx = 0;
 
+	nam_sz = strlen(hf.nam);
+	val_sz = strlen(hf.val);
+	if (nam_sz > UINT16_MAX || val_sz > UINT16_MAX) {
+		*idx = 0;
+		return (HPACK_RES_IDX);
+	}
+	hf.nam_sz = (uint16_t)nam_sz;
+	hf.val_sz = (uint16_t)val_sz;
+
 	retval = HPT_search(&hp->ctx, &hf);
 	*idx = hf.idx;
 	if (retval == HPACK_RES_OK && val == NULL)
@@ -495,6 +587,7 @@ hpack_hexdump(const void *ptr, size_t len, hpack_dump_f *dump, void *priv)
 void
 hpack_dump(const struct hpack *hp, hpack_dump_f *dump, void *priv)
 {
+	const uint8_t *tbl;
 	const char *magic;
 
 	if (hp == NULL || dump == NULL)
@@ -530,9 +623,26 @@ hpack_dump(const struct hpack *hp, hpack_dump_f *dump, void *priv)
 	/* XXX: do when bored */
 	dump(priv, "\t}\n");
 	dump(priv, "\t.cnt = %zu\n", hp->cnt);
+	dump(priv, "\t.rng = {\n");
+	dump(priv, "\t\t.bgn = %zu\n", hp->rng.bgn);
+	dump(priv, "\t\t.end = %zu\n", hp->rng.end);
+	dump(priv, "\t\t.wrp = %zu\n", hp->rng.wrp);
+	dump(priv, "\t}\n");
+	dump(priv, "\t.dir = {\n");
+	dump(priv, "\t\t.cap = %zu\n", hp->dir.cap);
+	dump(priv, "\t\t.bgn = %zu\n", hp->dir.bgn);
+	dump(priv, "\t}\n");
 
-	dump(priv, "\t.tbl = %p <<EOF\n", (const void *)hp->tbl);
-	hpack_hexdump(hp->tbl, hp->sz.len, dump, priv);
+	tbl = (const uint8_t *)hp->tbl;
+	dump(priv, "\t.tbl = %p <<EOF\n", (const void *)tbl);
+	if (hp->rng.wrp > 0) {
+		hpack_hexdump(tbl + hp->rng.bgn, hp->rng.wrp - hp->rng.bgn,
+		    dump, priv);
+		hpack_hexdump(tbl, hp->rng.end, dump, priv);
+	}
+	else
+		hpack_hexdump(tbl + hp->rng.bgn, hp->rng.end - hp->rng.bgn,
+		    dump, priv);
 	dump(priv, "\tEOF\n");
 	dump(priv, "}\n");
 }
@@ -542,52 +652,227 @@ hpack_dump(const struct hpack *hp, hpack_dump_f *dump, void *priv)
  */
 
 static int
-hpack_decode_raw_string(HPACK_CTX, size_t len)
+hpack_decode_raw_string(HPACK_CTX, struct hpack_str_state *str, size_t len)
 {
-	struct hpack_state *hs;
+	const char *raw;
 	unsigned fit;
 
-	hs = &ctx->hp->state;
 	fit = len <= ctx->ptr_len;
 	if (!fit)
 		len = ctx->ptr_len;
 
-	CALL(HPD_cat, ctx, (const char *)ctx->ptr.blk, len);
-	if (fit)
-		CALL(HPD_putc, ctx, '\0');
+	raw = (const char *)ctx->ptr.blk;
+	if (ctx->flg & HPACK_CTX_STM) {
+		/* a streamed value is validated and sent from the block */
+		str->cls = HPV_class(str->cls, raw, len);
+		EXPECT(ctx, CHR, str->cls != 0);
+		HPD_data(ctx, raw, len);
+	}
+	else {
+		CALL(HPD_copy, ctx, str, raw, len);
+		if (fit)
+			CALL(HPD_putc, ctx, '\0');
+	}
+
+	ctx->ptr.blk += len;
+	ctx->ptr_len -= len;
+	str->len -= len;
+	EXPECT(ctx, BUF, str->len == 0);
+
+	return (0);
+}
+
+/* NB: When a header list is discarded, only fields inserted in the dynamic
+ * table are decoded. The other fields are merely parsed: indexes are checked
+ * but strings are skipped without being decoded or validated.
+ */
+
+static int
+hpack_discard_index(HPACK_CTX, uint16_t idx)
+{
+
+	EXPECT(ctx, IDX, idx > 0);
+	EXPECT(ctx, IDX, idx <= HPACK_STATIC + ctx->hp->cnt);
+	return (0);
+}
+
+static int
+hpack_discard_string(HPACK_CTX, enum hpack_event_e evt)
+{
+	struct hpack_state *hs;
+	uint16_t len;
+
+	hs = &ctx->hp->state;
+	if (hs->stp == HPACK_STP_NAM_LEN || hs->stp == HPACK_STP_VAL_LEN) {
+		CALL(HPI_decode, ctx, HPACK_PFX_STR, &len);
+		if (evt == HPACK_EVT_NAME)
+			EXPECT(ctx, LEN, len > 0);
+		hs->magic = STR_STATE_MAGIC;
+		hs->stt.str.len = len;
+		hs->stp++;
+	}
 
+	assert(hs->magic == STR_STATE_MAGIC);
+	len = hs->stt.str.len;
+	if (len > ctx->ptr_len)
+		len = (uint16_t)ctx->ptr_len;
 	ctx->ptr.blk += len;
 	ctx->ptr_len -= len;
 	hs->stt.str.len -= len;
 	EXPECT(ctx, BUF, hs->stt.str.len == 0);
+	return (0);
+}
+
+static int
+hpack_discard_field(HPACK_CTX)
+{
+	struct hpack_state *hs;
+	enum hpi_prefix_e pfx;
+
+	hs = &ctx->hp->state;
+	switch (hs->stp) {
+	case HPACK_STP_FLD_INT:
+		if ((hs->typ & HPACK_PAT_IDX) == HPACK_PAT_IDX) {
+			CALL(HPI_decode, ctx, HPACK_PFX_IDX, &hs->idx);
+			return (hpack_discard_index(ctx, hs->idx));
+		}
+		pfx = (hs->typ & HPACK_PAT_NVR) == HPACK_PAT_NVR ?
+		    HPACK_PFX_NVR : HPACK_PFX_LIT;
+		CALL(HPI_decode, ctx, pfx, &hs->idx);
+		if (hs->idx > 0) {
+			CALL(hpack_discard_index, ctx, hs->idx);
+			hs->stp = HPACK_STP_VAL_LEN;
+			CALL(hpack_discard_string, ctx, HPACK_EVT_VALUE);
+			break;
+		}
+		hs->stp = HPACK_STP_NAM_LEN;
+		/* fall through */
+	case HPACK_STP_NAM_LEN:
+	case HPACK_STP_NAM_STR:
+		CALL(hpack_discard_string, ctx, HPACK_EVT_NAME);
+		hs->stp = HPACK_STP_VAL_LEN;
+		/* fall through */
+	case HPACK_STP_VAL_LEN:
+	case HPACK_STP_VAL_STR:
+		CALL(hpack_discard_string, ctx, HPACK_EVT_VALUE);
+		break;
+	default:
+		WRONG("Unknown step");
+	}
 
+	hs->stp = HPACK_STP_FLD_INT;
 	return (0);
 }
 
+static int
+hpack_raw_value(HPACK_CTX)
+{
+	const uint8_t *blk;
+	int retval;
+
+	/* NB: The value is reported as it appears in the block, with its
+	 * length prefix, and possibly in several parts across partial blocks.
+	 */
+	blk = ctx->ptr.blk;
+	retval = hpack_discard_string(ctx, HPACK_EVT_VALUE);
+	if (ctx->ptr.blk > blk)
+		HPC_notify(ctx, HPACK_EVT_RAW, blk,
+		    (size_t)(ctx->ptr.blk - blk));
+	return (retval);
+}
+
+static hpack_event_f hpack_assert_cb;
+
+static unsigned
+hpack_selected(HPACK_CTX)
+{
+
+	/* NB: Only hpack_decode() callers are subject to the interest set,
+	 * the other decoding functions have their own callback or none.
+	 */
+	if (ctx->hp->sel == NULL || ctx->cb == NULL ||
+	    ctx->cb == hpack_assert_cb ||
+	    (ctx->hp->state.typ & HPACK_PAT_DYN) == HPACK_PAT_DYN)
+		return (1);
+
+	return (HPT_selected(ctx));
+}
+
+static unsigned
+hpack_lazy(HPACK_CTX)
+{
+
+	/* NB: Only values in complete blocks are decoded lazily, so that
+	 * they can be reported in a single RAW event. The field itself may
+	 * have started in a previous partial block.
+	 */
+	return (ctx->arg.dec->flg & HPACK_DEC_LZY && !ctx->arg.dec->cut &&
+	    ctx->cb != NULL && ctx->ptr_len > 0 &&
+	    (ctx->hp->state.typ & HPACK_PAT_DYN) != HPACK_PAT_DYN &&
+	    *ctx->ptr.blk & HPACK_PAT_HUF);
+}
+
+static inline unsigned
+hpack_discarded(uint8_t typ)
+{
+
+	if ((typ & HPACK_PAT_IDX) == HPACK_PAT_IDX)
+		return (1);
+	return ((typ & HPACK_PAT_DYN) != HPACK_PAT_DYN &&
+	    (typ & HPACK_PAT_UPD) != HPACK_PAT_UPD);
+}
+
+static void
+hpack_decode_stream(HPACK_CTX, uint16_t len, uint8_t huf)
+{
+	size_t max;
+
+	/* NB: A value is streamed when it may not fit in the buffer. Values
+	 * of fields to index are always decoded in the buffer, and so are
+	 * values stored in a list.
+	 */
+	if (~ctx->arg.dec->flg & HPACK_DEC_STM || ctx->cb == NULL ||
+	    (ctx->hp->state.typ & HPACK_PAT_DYN) == HPACK_PAT_DYN)
+		return;
+
+	max = huf ? len * 8 / 5 : len;
+	if (max < ctx->buf_len)
+		return;
+
+	ctx->flg |= HPACK_CTX_STM;
+	HPC_notify(ctx, HPACK_EVT_NAME,  ctx->fld.nam, ctx->fld.nam_sz);
+	HPC_notify(ctx, HPACK_EVT_VALUE, NULL, len);
+}
+
 static int
 hpack_decode_string(HPACK_CTX, enum hpack_event_e evt)
 {
 	struct hpack_state *hs;
+	const char *str;
+	unsigned bgn;
 	uint16_t len;
 	uint8_t huf;
 
 	hs = &ctx->hp->state;
+	bgn = 0;
 
 	switch (hs->stp) {
 	case HPACK_STP_NAM_LEN:
 	case HPACK_STP_VAL_LEN:
-		/* decode integer */
-		huf = *ctx->ptr.blk & HPACK_PAT_HUF;
+		/* decode integer, the length may span partial blocks */
+		if (!hs->bsy)
+			hs->huf = *ctx->ptr.blk & HPACK_PAT_HUF;
 		CALL(HPI_decode, ctx, HPACK_PFX_STR, &len);
+		huf = hs->huf;
 
 		/* set up string decoding */
 		hs->magic = huf ?  HUF_STATE_MAGIC : STR_STATE_MAGIC;
 		hs->stt.str.len = len;
+		hs->stt.str.cls = evt == HPACK_EVT_NAME ?
+		    HPV_CLS_TOK : HPV_CLS_VAL;
 		hs->stp++;
 
 		if (huf) {
-			hs->stt.str.dec = NULL;
-			hs->stt.str.oct = NULL;
 			hs->stt.str.blen = 0;
 			hs->stt.str.bits = 0;
 		}
@@ -598,6 +883,28 @@ hpack_decode_string(HPACK_CTX, enum hpack_event_e evt)
 		if (len > 0)
 			EXPECT(ctx, BUF, ctx->ptr_len > 0);
 
+		if (!huf && ctx->flg & HPACK_CTX_REF && len <= ctx->ptr_len) {
+			/* reference the string in the block */
+			str = len > 0 ? (const char *)ctx->ptr.blk : "";
+			ctx->ptr.blk += len;
+			ctx->ptr_len -= len;
+			hs->stt.str.len = 0;
+			hs->stt.str.cls = HPV_class(hs->stt.str.cls, str, len);
+			if (evt == HPACK_EVT_NAME) {
+				ctx->fld.nam = str;
+				ctx->fld.nam_sz = len;
+			}
+			else {
+				ctx->fld.val = str;
+				ctx->fld.val_sz = len;
+			}
+			return (0);
+		}
+
+		if (evt == HPACK_EVT_VALUE)
+			hpack_decode_stream(ctx, len, huf);
+
+		bgn = 1;
 		/* fall through */
 	case HPACK_STP_NAM_STR:
 	case HPACK_STP_VAL_STR:
@@ -610,11 +917,26 @@ hpack_decode_string(HPACK_CTX, enum hpack_event_e evt)
 
 	assert(hs->stt.str.len > 0 || evt != HPACK_EVT_NAME);
 
-	if (hs->magic == HUF_STATE_MAGIC)
-		CALL(HPH_decode, ctx, hs->stt.str.len);
+	if (hs->magic == HUF_STATE_MAGIC && bgn && evt == HPACK_EVT_VALUE)
+		CALL(HPH_decode_cached, ctx, &hs->stt.str, hs->stt.str.len);
+	else if (hs->magic == HUF_STATE_MAGIC)
+		CALL(HPH_decode, ctx, &hs->stt.str, hs->stt.str.len);
 	else {
 		assert(hs->magic == STR_STATE_MAGIC);
-		CALL(hpack_decode_raw_string, ctx, hs->stt.str.len);
+		CALL(hpack_decode_raw_string, ctx, &hs->stt.str,
+		    hs->stt.str.len);
+	}
+
+	if (ctx->flg & HPACK_CTX_STM)
+		return (0);
+
+	if (evt == HPACK_EVT_NAME) {
+		assert(ctx->buf > ctx->fld.nam);
+		ctx->fld.nam_sz = (size_t)(ctx->buf - ctx->fld.nam - 1);
+	}
+	else {
+		assert(ctx->buf > ctx->fld.val);
+		ctx->fld.val_sz = (size_t)(ctx->buf - ctx->fld.val - 1);
 	}
 
 	return (0);
@@ -631,23 +953,39 @@ hpack_decode_field(HPACK_CTX)
 		/* fall through */
 	case HPACK_STP_NAM_LEN:
 	case HPACK_STP_NAM_STR:
-		if (ctx->hp->state.idx == 0)
+		/* NB: Indexed names were already validated, and decoded
+		 * strings are classified on the fly.
+		 */
+		if (ctx->hp->state.idx == 0) {
 			CALL(hpack_decode_string, ctx, HPACK_EVT_NAME);
+			assert(ctx->fld.nam_sz > 0);
+			CALL(HPV_name, ctx, ctx->fld.nam, ctx->fld.nam_sz,
+			    ctx->hp->state.stt.str.cls);
+		}
 		else
 			CALL(HPT_decode_name, ctx);
-		assert(ctx->buf > ctx->fld.nam);
-		ctx->fld.nam_sz = (size_t)(ctx->buf - ctx->fld.nam - 1);
-		CALL(HPV_token, ctx, ctx->fld.nam, ctx->fld.nam_sz);
 		ctx->fld.val = ctx->buf;
 		ctx->hp->state.stp = HPACK_STP_VAL_LEN;
+		if (!hpack_selected(ctx) || hpack_lazy(ctx)) {
+			ctx->flg |= HPACK_CTX_RAW;
+			HPC_notify(ctx, HPACK_EVT_NAME, ctx->fld.nam,
+			    ctx->fld.nam_sz);
+		}
 		/* fall through */
 	case HPACK_STP_VAL_LEN:
 	case HPACK_STP_VAL_STR:
+		if (ctx->flg & HPACK_CTX_RAW) {
+			CALL(hpack_raw_value, ctx);
+			ctx->flg &= ~HPACK_CTX_RAW;
+			ctx->hp->state.stp = HPACK_STP_FLD_INT;
+			break;
+		}
 		CALL(hpack_decode_string, ctx, HPACK_EVT_VALUE);
-		assert(ctx->buf > ctx->fld.val);
-		ctx->fld.val_sz = (size_t)(ctx->buf - ctx->fld.val - 1);
-		CALL(HPV_value, ctx, ctx->fld.val, ctx->fld.val_sz);
-		HPD_notify(ctx);
+		EXPECT(ctx, CHR, ctx->hp->state.stt.str.cls != 0);
+		if (ctx->flg & HPACK_CTX_STM)
+			ctx->flg &= ~HPACK_CTX_STM;
+		else
+			HPD_notify(ctx);
 		ctx->hp->state.stp = HPACK_STP_FLD_INT;
 		break;
 	default:
@@ -660,11 +998,12 @@ hpack_decode_field(HPACK_CTX)
 static int
 hpack_decode_indexed(HPACK_CTX)
 {
-	uint16_t idx;
+	struct hpack_state *hs;
 
-	CALL(HPI_decode, ctx, HPACK_PFX_IDX, &idx);
-	HPC_notify(ctx, HPACK_EVT_FIELD, NULL, idx);
-	return (HPT_decode(ctx, idx));
+	hs = &ctx->hp->state;
+	CALL(HPI_decode, ctx, HPACK_PFX_IDX, &hs->idx);
+	HPC_notify(ctx, HPACK_EVT_FIELD, NULL, hs->idx);
+	return (HPT_decode(ctx, hs->idx));
 }
 
 static int
@@ -737,23 +1076,228 @@ hpack_decode_update(HPACK_CTX)
 	return (0);
 }
 
+/* NB: When a field starts in a complete block, it can't be interrupted and
+ * there is no need to keep track of the decoding steps. Its representation
+ * is found with a lookup on the first octet, integers are decoded inline,
+ * and strings in one go.
+ */
+
+typedef int hpack_fast_f(HPACK_CTX);
+
+static inline int
+hpack_fast_int(HPACK_CTX, enum hpi_prefix_e pfx, uint16_t *val)
+{
+	const uint8_t *blk, *end;
+	uint16_t v, n;
+	uint8_t b, m, mask;
+
+	EXPECT(ctx, BUF, ctx->ptr_len > 0);
+	blk = ctx->ptr.blk;
+	end = blk + ctx->ptr_len;
+	mask = (uint8_t)((1 << pfx) - 1);
+	v = *blk & mask;
+	blk++;
+
+	if (v == mask) {
+		m = 0;
+		do {
+			EXPECT(ctx, BUF, blk < end);
+			b = *blk;
+			n = v;
+			if (m <= 16)
+				n += (b & 0x7f) << m;
+			else
+				EXPECT(ctx, INT, (b & 0x7f) == 0);
+			EXPECT(ctx, INT, v <= n);
+			v = n;
+			m += 7;
+			blk++;
+		} while (b & 0x80);
+	}
+
+	ctx->ptr_len -= (size_t)(blk - ctx->ptr.blk);
+	ctx->ptr.blk = blk;
+	*val = v;
+	return (0);
+}
+
+static int
+hpack_fast_string(HPACK_CTX, enum hpack_event_e evt)
+{
+	struct hpack_state *hs;
+	const char *str;
+	uint16_t len;
+	uint8_t huf;
+
+	hs = &ctx->hp->state;
+	EXPECT(ctx, BUF, ctx->ptr_len > 0);
+	huf = *ctx->ptr.blk & HPACK_PAT_HUF;
+	CALL(hpack_fast_int, ctx, HPACK_PFX_STR, &len);
+
+	if (evt == HPACK_EVT_NAME)
+		EXPECT(ctx, LEN, len > 0);
+	if (len > 0)
+		EXPECT(ctx, BUF, ctx->ptr_len > 0);
+
+	hs->stt.str.len = len;
+	hs->stt.str.cls = evt == HPACK_EVT_NAME ? HPV_CLS_TOK : HPV_CLS_VAL;
+
+	if (!huf && ctx->flg & HPACK_CTX_REF && len <= ctx->ptr_len) {
+		str = len > 0 ? (const char *)ctx->ptr.blk : "";
+		ctx->ptr.blk += len;
+		ctx->ptr_len -= len;
+		hs->stt.str.len = 0;
+		hs->stt.str.cls = HPV_class(hs->stt.str.cls, str, len);
+		if (evt == HPACK_EVT_NAME) {
+			ctx->fld.nam = str;
+			ctx->fld.nam_sz = len;
+		}
+		else {
+			ctx->fld.val = str;
+			ctx->fld.val_sz = len;
+		}
+		return (0);
+	}
+
+	if (evt == HPACK_EVT_VALUE)
+		hpack_decode_stream(ctx, len, huf);
+
+	if (huf) {
+		hs->magic = HUF_STATE_MAGIC;
+		hs->stt.str.bits = 0;
+		hs->stt.str.blen = 0;
+		if (evt == HPACK_EVT_VALUE)
+			CALL(HPH_decode_cached, ctx, &hs->stt.str, len);
+		else
+			CALL(HPH_decode, ctx, &hs->stt.str, len);
+	}
+	else {
+		hs->magic = STR_STATE_MAGIC;
+		CALL(hpack_decode_raw_string, ctx, &hs->stt.str, len);
+	}
+
+	if (ctx->flg & HPACK_CTX_STM)
+		return (0);
+
+	if (evt == HPACK_EVT_NAME)
+		ctx->fld.nam_sz = (size_t)(ctx->buf - ctx->fld.nam - 1);
+	else
+		ctx->fld.val_sz = (size_t)(ctx->buf - ctx->fld.val - 1);
+
+	return (0);
+}
+
+static int
+hpack_fast_field(HPACK_CTX, enum hpi_prefix_e pfx)
+{
+	struct hpack_state *hs;
+
+	hs = &ctx->hp->state;
+	CALL(hpack_fast_int, ctx, pfx, &hs->idx);
+	HPC_notify(ctx, HPACK_EVT_FIELD, NULL, 0);
+	if (pfx == HPACK_PFX_NVR)
+		HPC_notify(ctx, HPACK_EVT_NEVER, NULL, 0);
+
+	ctx->fld.nam = ctx->buf;
+	if (hs->idx == 0) {
+		CALL(hpack_fast_string, ctx, HPACK_EVT_NAME);
+		CALL(HPV_name, ctx, ctx->fld.nam, ctx->fld.nam_sz,
+		    hs->stt.str.cls);
+	}
+	else
+		CALL(HPT_decode_name, ctx);
+
+	if (!hpack_selected(ctx) || hpack_lazy(ctx)) {
+		HPC_notify(ctx, HPACK_EVT_NAME, ctx->fld.nam, ctx->fld.nam_sz);
+		hs->stp = HPACK_STP_VAL_LEN;
+		CALL(hpack_raw_value, ctx);
+		hs->stp = HPACK_STP_FLD_INT;
+		return (0);
+	}
+
+	ctx->fld.val = ctx->buf;
+	CALL(hpack_fast_string, ctx, HPACK_EVT_VALUE);
+	EXPECT(ctx, CHR, hs->stt.str.cls != 0);
+	if (ctx->flg & HPACK_CTX_STM)
+		ctx->flg &= ~HPACK_CTX_STM;
+	else
+		HPD_notify(ctx);
+	return (0);
+}
+
+static int
+hpack_fast_indexed(HPACK_CTX)
+{
+	struct hpack_state *hs;
+
+	hs = &ctx->hp->state;
+	CALL(hpack_fast_int, ctx, HPACK_PFX_IDX, &hs->idx);
+	HPC_notify(ctx, HPACK_EVT_FIELD, NULL, hs->idx);
+	return (HPT_decode(ctx, hs->idx));
+}
+
+static int
+hpack_fast_dynamic(HPACK_CTX)
+{
+
+	CALL(hpack_fast_field, ctx, HPACK_PFX_DYN);
+	HPT_index(ctx);
+	return (0);
+}
+
+static int
+hpack_fast_literal(HPACK_CTX)
+{
+
+	return (hpack_fast_field(ctx, HPACK_PFX_LIT));
+}
+
+static int
+hpack_fast_never(HPACK_CTX)
+{
+
+	return (hpack_fast_field(ctx, HPACK_PFX_NVR));
+}
+
+#define HPF_X4(f)	f, f, f, f
+#define HPF_X16(f)	HPF_X4(f), HPF_X4(f), HPF_X4(f), HPF_X4(f)
+#define HPF_X32(f)	HPF_X16(f), HPF_X16(f)
+#define HPF_X64(f)	HPF_X32(f), HPF_X32(f)
+
+static hpack_fast_f * const hpack_fast[256] = {
+	HPF_X16(hpack_fast_literal),	/* 0000xxxx */
+	HPF_X16(hpack_fast_never),	/* 0001xxxx */
+	HPF_X32(hpack_decode_update),	/* 001xxxxx */
+	HPF_X64(hpack_fast_dynamic),	/* 01xxxxxx */
+	HPF_X64(hpack_fast_indexed),	/* 1xxxxxxx */
+	HPF_X64(hpack_fast_indexed),
+};
+
+#undef HPF_X4
+#undef HPF_X16
+#undef HPF_X32
+#undef HPF_X64
+
 static inline unsigned
 hpack_check_buffer(struct hpack_ctx *ctx, const struct hpack_decoding *dec)
 {
 	char *dec_buf = dec->buf;
 
+	if (ctx->seg != NULL)
+		return (dec->flg & HPACK_DEC_GRW &&
+		    ctx->seg->buf + ctx->seg->len == ctx->buf + ctx->buf_len);
 	return (dec_buf + dec->buf_len == ctx->buf + ctx->buf_len);
 }
 
-enum hpack_result_e
-hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
+static enum hpack_result_e
+hpack_decode_block(struct hpack *hp, const struct hpack_decoding *dec)
 {
 	struct hpack_ctx *ctx;
 	int retval;
 
 	if (hp == NULL || hp->magic != DECODER_MAGIC || dec == NULL ||
 	    dec->blk == NULL || dec->blk_len == 0 || dec->buf == NULL ||
-	    dec->buf_len == 0 || dec->cb == NULL)
+	    dec->buf_len == 0)
 		return (HPACK_RES_ARG);
 
 	retval = -1;
@@ -767,9 +1311,11 @@ hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 	else {
 		assert(ctx->res == HPACK_RES_OK);
 		EXPECT(ctx, ARG, (ctx->flg & HPACK_CTX_TOO_BIG) == 0);
+		HPD_release(ctx);
 		ctx->buf = dec->buf;
 		ctx->buf_len = dec->buf_len;
 		ctx->flg |= HPACK_CTX_CAN_UPD;
+		ctx->flg &= ~(HPACK_CTX_STM | HPACK_CTX_RAW);
 		hp->state.stp = HPACK_STP_FLD_INT;
 	}
 
@@ -778,8 +1324,17 @@ hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 	ctx->ptr_len = dec->blk_len;
 	ctx->cb = dec->cb;
 	ctx->priv = dec->priv;
+	ctx->ign = dec->ign;
 	ctx->res = dec->cut ? HPACK_RES_BLK : HPACK_RES_OK;
 
+	/* NB: Strings may only reference a complete block, the caller may
+	 * reuse a partial block before the field is complete.
+	 */
+	if (dec->flg & HPACK_DEC_REF && !dec->cut)
+		ctx->flg |= HPACK_CTX_REF;
+	else
+		ctx->flg &= ~HPACK_CTX_REF;
+
 	while (ctx->ptr_len > 0) {
 		if (!hp->state.bsy && hp->state.stp == HPACK_STP_FLD_INT)
 			hp->state.typ = *ctx->ptr.blk;
@@ -791,6 +1346,12 @@ hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 			assert(hp->sz.min < 0);
 			ctx->flg &= ~HPACK_CTX_CAN_UPD;
 		}
+		if (ctx->flg & HPACK_CTX_DSC && hpack_discarded(hp->state.typ))
+			retval = hpack_discard_field(ctx);
+		else if (!dec->cut && !hp->state.bsy &&
+		    hp->state.stp == HPACK_STP_FLD_INT)
+			retval = hpack_fast[hp->state.typ](ctx);
+		else
 #define HPACK_DECODE(l, U, or)						\
 		if ((hp->state.typ & HPACK_PAT_##U) == HPACK_PAT_##U)	\
 			retval = hpack_decode_##l(ctx);			\
@@ -810,6 +1371,11 @@ hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 			return (ctx->res);
 		}
 		memset(&ctx->fld, 0, sizeof ctx->fld);
+		if (ctx->flg & HPACK_CTX_DSC) {
+			/* discarded fields are not kept in the buffer */
+			ctx->buf = dec->buf;
+			ctx->buf_len = dec->buf_len;
+		}
 	}
 
 	assert(ctx->res == HPACK_RES_OK || ctx->res == HPACK_RES_BLK);
@@ -818,15 +1384,156 @@ hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 	return (ctx->res);
 }
 
-static void
-hpack_assert_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
+enum hpack_result_e
+hpack_decode(struct hpack *hp, const struct hpack_decoding *dec)
 {
 
-#ifdef NDEBUG
-	(void)buf;
-	(void)len;
-#endif
-	(void)priv;
+	if (hp == NULL || hp->magic != DECODER_MAGIC || hp->ctx.lst != NULL ||
+	    hp->ctx.flg & HPACK_CTX_DSC || dec == NULL || dec->cb == NULL)
+		return (HPACK_RES_ARG);
+
+	return (hpack_decode_block(hp, dec));
+}
+
+enum hpack_result_e
+hpack_discard(struct hpack *hp, const struct hpack_decoding *dec)
+{
+	struct hpack_decoding dsc_dec;
+	struct hpack_ctx *ctx;
+	enum hpack_result_e retval;
+
+	if (hp == NULL || hp->magic != DECODER_MAGIC || hp->ctx.lst != NULL ||
+	    dec == NULL)
+		return (HPACK_RES_ARG);
+
+	ctx = &hp->ctx;
+	assert(ctx->hp == hp);
+
+	if (ctx->res == HPACK_RES_BLK)
+		EXPECT(ctx, ARG, ctx->flg & HPACK_CTX_DSC);
+	else
+		ctx->flg |= HPACK_CTX_DSC;
+
+	/* NB: No events are sent, and the buffer only holds the field being
+	 * inserted in the dynamic table.
+	 */
+	(void)memcpy(&dsc_dec, dec, sizeof dsc_dec);
+	dsc_dec.cb = NULL;
+	dsc_dec.priv = NULL;
+	dsc_dec.flg &= ~(HPACK_DEC_GRW | HPACK_DEC_STM | HPACK_DEC_LZY);
+
+	retval = hpack_decode_block(hp, &dsc_dec);
+	if (retval != HPACK_RES_BLK)
+		ctx->flg &= ~HPACK_CTX_DSC;
+	return (retval);
+}
+
+enum hpack_result_e
+hpack_decode_list(struct hpack *hp, const struct hpack_decoding *dec,
+    struct hpack_field *lst, size_t *cnt)
+{
+	struct hpack_decoding lst_dec;
+	struct hpack_ctx *ctx;
+	enum hpack_result_e retval;
+
+	if (hp == NULL || hp->magic != DECODER_MAGIC || dec == NULL ||
+	    lst == NULL || cnt == NULL || *cnt == 0)
+		return (HPACK_RES_ARG);
+
+	ctx = &hp->ctx;
+	assert(ctx->hp == hp);
+
+	if (ctx->res == HPACK_RES_BLK)
+		EXPECT(ctx, ARG, ctx->lst == lst && ctx->lst_len == *cnt);
+	else {
+		assert(ctx->lst == NULL);
+		ctx->lst = lst;
+		ctx->lst_len = *cnt;
+		ctx->lst_cnt = 0;
+	}
+
+	/* NB: Fields are stored in the list instead of being notified, and
+	 * other events are simply not sent. Strings are always copied since
+	 * a later field may evict a dynamic entry the list would point to.
+	 */
+	(void)memcpy(&lst_dec, dec, sizeof lst_dec);
+	lst_dec.cb = NULL;
+	lst_dec.priv = NULL;
+	lst_dec.flg &= ~(HPACK_DEC_REF | HPACK_DEC_LZY);
+
+	retval = hpack_decode_block(hp, &lst_dec);
+	if (retval == HPACK_RES_BLK)
+		return (retval);
+
+	/* NB: A header list that didn't fit is skipped, and strings that
+	 * were already stored may have been overwritten in the buffer.
+	 */
+	*cnt = retval == HPACK_RES_OK ? ctx->lst_cnt : 0;
+	ctx->lst = NULL;
+	return (retval);
+}
+
+enum hpack_result_e
+hpack_decode_value(const void *raw, size_t raw_len, char *buf, size_t *len)
+{
+	struct hpack_decoding dec;
+	struct hpack_str_state str;
+	struct hpack_ctx ctx;
+	uint16_t str_len;
+	uint8_t huf;
+	int retval;
+
+	if (raw == NULL || raw_len == 0 || buf == NULL || len == NULL ||
+	    *len == 0)
+		return (HPACK_RES_ARG);
+
+	/* NB: The value is decoded with a standalone context, without a
+	 * decoder, so the string state is kept on the stack.
+	 */
+	(void)memset(&dec, 0, sizeof dec);
+	dec.buf = buf;
+	dec.buf_len = *len;
+
+	(void)memset(&ctx, 0, sizeof ctx);
+	ctx.arg.dec = &dec;
+	ctx.ptr.blk = raw;
+	ctx.ptr_len = raw_len;
+	ctx.buf = buf;
+	ctx.buf_len = *len;
+	ctx.fld.nam = buf;
+	ctx.fld.val = buf;
+
+	huf = *ctx.ptr.blk & HPACK_PAT_HUF;
+	if (hpack_fast_int(&ctx, HPACK_PFX_STR, &str_len) != 0)
+		return (ctx.res);
+	if (str_len < ctx.ptr_len)
+		return (HPACK_RES_ARG);
+
+	(void)memset(&str, 0, sizeof str);
+	str.len = str_len;
+	str.cls = HPV_CLS_VAL;
+	if (huf)
+		retval = HPH_decode(&ctx, &str, str_len);
+	else
+		retval = hpack_decode_raw_string(&ctx, &str, str_len);
+	if (retval != 0)
+		return (ctx.res);
+	if (str.cls == 0)
+		return (HPACK_RES_CHR);
+
+	*len = (size_t)(ctx.buf - buf - 1);
+	return (HPACK_RES_OK);
+}
+
+static void
+hpack_assert_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
+{
+
+#ifdef NDEBUG
+	(void)buf;
+	(void)len;
+#endif
+	(void)priv;
 
 	switch (evt) {
 	case HPACK_EVT_FIELD:
@@ -852,6 +1559,7 @@ hpack_assert_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
 		assert(len == strlen(buf));
 		break;
 	case HPACK_EVT_DATA:
+	case HPACK_EVT_RAW:
 		WRONG("Invalid event");
 	default:
 		WRONG("Unknown event");
@@ -887,6 +1595,7 @@ hpack_decode_fields(struct hpack *hp, const struct hpack_decoding *dec,
 	if (nam == NULL) {
 		memcpy(&fld_dec, dec, sizeof fld_dec);
 		fld_dec.cb = hpack_assert_cb;
+		fld_dec.flg = 0; /* fields are read back from the buffer */
 		retval = hpack_decode(hp, &fld_dec);
 		if (retval != HPACK_RES_OK)
 			return (retval);
@@ -938,35 +1647,406 @@ hpack_skip(struct hpack *hp)
  * Encoder
  */
 
+static uint32_t
+hpack_preset_key(const char *str, size_t len)
+{
+
+	/* NB: Values are told apart by their length and a few characters,
+	 * the lookup is confirmed with a comparison.
+	 */
+	assert(len > 0);
+	return ((uint32_t)len * 0x9e3779b1 ^
+	    (uint32_t)(uint8_t)str[0] << 8 ^
+	    (uint32_t)(uint8_t)str[len / 2] << 16 ^
+	    (uint32_t)(uint8_t)str[len - 1] << 24);
+}
+
+static const struct hpe_value *
+hpack_preset_lookup(const struct hpack_preset *pst, const char *str,
+    size_t len)
+{
+	const struct hpe_value *hv;
+	const char *buf;
+	uint32_t key;
+	size_t bkt;
+
+	assert(pst->magic == PRESET_MAGIC);
+	if (len == 0 || len > UINT16_MAX)
+		return (NULL);
+
+	key = hpack_preset_key(str, len);
+	buf = (const char *)(pst->val + pst->msk + 1);
+	for (bkt = key & pst->msk; pst->val[bkt].val_sz > 0;
+	    bkt = (bkt + 1) & pst->msk) {
+		hv = &pst->val[bkt];
+		if (hv->key == key && hv->val_sz == len &&
+		    !memcmp(buf + hv->off, str, len))
+			return (hv);
+	}
+	return (NULL);
+}
+
+struct hpack_preset *
+hpack_preset(const char * const *val, size_t cnt, const struct hpack_alloc *ha)
+{
+	struct hpack_encoding enc;
+	struct hpack_ctx ctx;
+	struct hpack_preset *pst;
+	struct hpe_value *hv;
+	size_t bkt, i, len, mem, off, sz;
+	char *buf;
+
+	if (val == NULL || cnt == 0 || cnt > UINT16_MAX || ha == NULL ||
+	    ha->malloc == NULL)
+		return (NULL);
+
+	mem = 0;
+	for (i = 0; i < cnt; i++) {
+		if (val[i] == NULL)
+			return (NULL);
+		len = strlen(val[i]);
+		if (len == 0 || len > UINT16_MAX ||
+		    HPV_class(HPV_CLS_VAL, val[i], len) == 0)
+			return (NULL);
+		mem += len + HPH_shrink(val[i], len);
+	}
+
+	bkt = 1;
+	while (bkt < cnt * 2)
+		bkt <<= 1;
+
+	pst = ha->malloc(sizeof *pst + bkt * sizeof *hv + mem, ha->priv);
+	if (pst == NULL)
+		return (NULL);
+
+	(void)memset(pst, 0, sizeof *pst + bkt * sizeof *hv);
+	pst->magic = PRESET_MAGIC;
+	(void)memcpy(&pst->alloc, ha, sizeof *ha);
+	pst->msk = bkt - 1;
+	buf = (char *)(pst->val + bkt);
+
+	/* NB: Values are stored with the representation an automatic
+	 * Huffman encoding would pick, a preset is never modified after it
+	 * is built.
+	 */
+	off = 0;
+	for (i = 0; i < cnt; i++) {
+		len = strlen(val[i]);
+		if (hpack_preset_lookup(pst, val[i], len) != NULL)
+			continue; /* duplicate */
+
+		bkt = hpack_preset_key(val[i], len) & pst->msk;
+		while (pst->val[bkt].val_sz > 0)
+			bkt = (bkt + 1) & pst->msk;
+
+		hv = &pst->val[bkt];
+		hv->key = hpack_preset_key(val[i], len);
+		hv->off = (uint32_t)off;
+		hv->val_sz = (uint16_t)len;
+		(void)memcpy(buf + off, val[i], len);
+		off += len;
+
+		sz = HPH_shrink(val[i], len);
+		if (sz < len) {
+			(void)memset(&enc, 0, sizeof enc);
+			(void)memset(&ctx, 0, sizeof ctx);
+			enc.buf = buf + off;
+			enc.buf_len = sz;
+			ctx.arg.enc = &enc;
+			ctx.ptr.cur = enc.buf;
+			HPH_encode(&ctx, val[i], len);
+			assert(ctx.ptr_len == sz);
+			hv->huf = 1;
+			off += sz;
+		}
+		else
+			sz = len;
+		hv->enc_sz = (uint16_t)sz;
+	}
+
+	assert(off <= mem);
+	return (pst);
+}
+
+void
+hpack_preset_free(struct hpack_preset **pstp)
+{
+	struct hpack_preset *pst;
+
+	if (pstp == NULL)
+		return;
+
+	pst = *pstp;
+	if (pst == NULL)
+		return;
+
+	*pstp = NULL;
+	if (pst->magic != PRESET_MAGIC)
+		return;
+
+	pst->magic = 0;
+	if (pst->alloc.free != NULL)
+		pst->alloc.free(pst, pst->alloc.priv);
+}
+
+enum hpack_result_e
+hpack_precode_value(const char *val, size_t val_len, uint32_t flg, void *buf,
+    size_t *len)
+{
+	struct hpack_encoding enc;
+	struct hpack_ctx ctx;
+	enum hpi_prefix_e pfx;
+	enum hpi_pattern_e pat;
+	size_t sz;
+	char *cur;
+
+	if (val == NULL || buf == NULL || len == NULL ||
+	    flg & ~(HPACK_FLG_VAL_HUF | HPACK_FLG_VAL_AUT))
+		return (HPACK_RES_ARG);
+
+	if (val_len > UINT16_MAX)
+		return (HPACK_RES_INT);
+
+	if (HPV_class(HPV_CLS_VAL, val, val_len) == 0)
+		return (HPACK_RES_CHR);
+
+	if (flg & HPACK_FLG_VAL_AUT) {
+		sz = HPH_shrink(val, val_len);
+		if (sz >= val_len)
+			flg = 0;
+	}
+	else if (flg & HPACK_FLG_VAL_HUF)
+		sz = HPH_size(val, val_len);
+	else
+		sz = val_len;
+
+	if (sz > UINT16_MAX)
+		return (HPACK_RES_INT);
+
+	if (flg != 0) {
+		pfx = HPACK_PFX_HUF;
+		pat = HPACK_PAT_HUF;
+	}
+	else {
+		pfx = HPACK_PFX_STR;
+		pat = HPACK_PAT_STR;
+		sz = val_len;
+	}
+
+	/* NB: The plain value comes first, so that the pre-encoded value
+	 * remains a regular string for the dynamic table and index lookups.
+	 * Its representation follows the null character.
+	 */
+	if (*len < val_len + 1 + HPACK_PRE_HDR + HPI_size(pfx, (uint16_t)sz) +
+	    sz)
+		return (HPACK_RES_BIG);
+
+	cur = buf;
+	(void)memcpy(cur, val, val_len);
+	cur += val_len;
+	*cur++ = '\0';
+	*cur++ = (char)HPACK_PRE_MARK;
+	*cur++ = (char)(val_len >> 8);
+	*cur++ = (char)val_len;
+
+	/* NB: The context has no callback and its buffer is exactly the
+	 * size of the representation, so it is never flushed.
+	 */
+	(void)memset(&enc, 0, sizeof enc);
+	(void)memset(&ctx, 0, sizeof ctx);
+	enc.buf = cur;
+	enc.buf_len = HPI_size(pfx, (uint16_t)sz) + sz;
+	ctx.arg.enc = &enc;
+	ctx.ptr.cur = enc.buf;
+
+	HPI_encode(&ctx, pfx, pat, (uint16_t)sz);
+	if (flg != 0)
+		HPH_encode(&ctx, val, val_len);
+	else
+		HPE_bcat(&ctx, val, val_len);
+
+	assert(ctx.ptr_len == enc.buf_len);
+	*len = val_len + 1 + HPACK_PRE_HDR + ctx.ptr_len;
+	return (HPACK_RES_OK);
+}
+
+static size_t
+hpack_precoded_size(const char *val, size_t len)
+{
+	const uint8_t *pre;
+	size_t n, sz;
+	unsigned sft;
+
+	/* NB: A pre-encoded value starts with the plain value, a null
+	 * character and a header with a marker and the plain length, see
+	 * hpack_precode_value(). The representation that follows is checked
+	 * against them, and its length prefix can't exceed UINT16_MAX, so a
+	 * buffer that didn't come from hpack_precode_value() or a wrong
+	 * length is rejected instead of read past its end. The result is the
+	 * size of the representation, or zero.
+	 */
+	pre = (const uint8_t *)val + len;
+	if (len > UINT16_MAX || pre[0] != '\0' || pre[1] != HPACK_PRE_MARK ||
+	    (size_t)((pre[2] << 8) | pre[3]) != len)
+		return (0);
+
+	pre += 1 + HPACK_PRE_HDR;
+	sz = *pre & 0x7f;
+	n = 1;
+	if (sz == 0x7f) {
+		sft = 0;
+		do {
+			if (n > 3)
+				return (0);
+			sz += (size_t)(pre[n] & 0x7f) << sft;
+			sft += 7;
+		} while (pre[n++] & 0x80);
+	}
+
+	if (sz > UINT16_MAX)
+		return (0);
+	if (*pre & 0x80) {
+		if (sz < (len * 5 + 7) >> 3 || sz > (len * 28 + 7) >> 3)
+			return (0);
+	}
+	else if (sz != len)
+		return (0);
+	return (n + sz);
+}
+
+static int
+hpack_encode_huffman(HPACK_CTX, const char *str, size_t len, unsigned aut)
+{
+	struct hph_state hs;
+	uint8_t *cur;
+	size_t lim, max, off, pfx, room, sz, tmp;
+
+	/* NB: Valid characters have codes of at most 28 bits, so the length
+	 * prefix is reserved for the worst case and the string is encoded
+	 * right after it, until the end of the buffer. The prefix is moved
+	 * back once the actual width is known. Only when the buffer is full
+	 * is the size of the remaining characters computed.
+	 *
+	 * With automatic coding, the encoding also stops as soon as it can't
+	 * be shorter than the string, which is then copied instead.
+	 */
+	if (aut && len == 0)
+		max = 0;
+	else if (aut)
+		max = len - 1;
+	else
+		max = (len * 28 + 7) >> 3;
+	if (max > UINT16_MAX)
+		max = UINT16_MAX;
+
+	hs.str = str;
+	hs.len = len;
+	hs.bits = 0;
+	hs.sz = 0;
+
+	cur = ctx->ptr.cur;
+	pfx = HPI_size(HPACK_PFX_HUF, (uint16_t)max);
+	room = ctx->arg.enc->buf_len - ctx->ptr_len;
+	lim = room > pfx ? room - pfx : 0;
+	if (aut && lim > max)
+		lim = max;
+	off = HPH_fill(&hs, cur + pfx, lim);
+
+	if (hs.len == 0 && hs.sz == 0)
+		sz = off;
+	else if (aut && lim == max)
+		sz = len;
+	else
+		sz = off + HPH_pending(&hs);
+
+	if (aut && sz >= len) {
+		HPI_encode(ctx, HPACK_PFX_STR, HPACK_PAT_STR, (uint16_t)len);
+		HPE_bcat(ctx, str, len);
+		return (0);
+	}
+
+	EXPECT(ctx, INT, sz <= UINT16_MAX);
+
+	tmp = HPI_size(HPACK_PFX_HUF, (uint16_t)sz);
+	assert(tmp <= pfx);
+	if (off > 0 && tmp != pfx)
+		(void)memmove(cur + tmp, cur + pfx, off);
+
+	HPI_encode(ctx, HPACK_PFX_HUF, HPACK_PAT_HUF, (uint16_t)sz);
+	if (off > 0) {
+		assert(ctx->ptr.cur == cur + tmp);
+		ctx->ptr.cur += off;
+		ctx->ptr_len += off;
+		if (ctx->ptr_len == ctx->arg.enc->buf_len)
+			HPE_send(ctx);
+	}
+
+	if (hs.len > 0 || hs.sz > 0)
+		HPH_resume(ctx, &hs);
+	return (0);
+}
+
 static int
 hpack_encode_string(HPACK_CTX, HPACK_FLD, enum hpack_event_e evt)
 {
-	const char *str;
-	size_t len;
-	unsigned huf;
+	const struct hpack_preset *pst;
+	const struct hpe_value *hv;
+	const char *buf, *str;
+	size_t len, sz;
+	unsigned aut, huf;
 	hpack_validate_f *val;
 
 	if (evt == HPACK_EVT_NAME) {
 		assert(~fld->flg & HPACK_FLG_NAM_IDX);
-		str = fld->nam;
+		str = ctx->fld.nam;
+		len = ctx->fld.nam_sz;
 		huf = fld->flg & HPACK_FLG_NAM_HUF;
+		aut = fld->flg & HPACK_FLG_NAM_AUT;
 		val = HPV_token;
 	}
 	else {
-		str = fld->val;
+		str = ctx->fld.val;
+		len = ctx->fld.val_sz;
 		huf = fld->flg & HPACK_FLG_VAL_HUF;
+		aut = fld->flg & HPACK_FLG_VAL_AUT;
 		val = HPV_value;
 	}
 
-	len = strlen(str);
 	EXPECT(ctx, INT, len <= UINT16_MAX);
-	CALL(val, ctx, str, len);
 
-	if (huf != 0) {
-		len = HPH_size(str);
-		HPI_encode(ctx, HPACK_PFX_HUF, HPACK_PAT_HUF, (uint16_t)len);
-		HPH_encode(ctx, str);
+	if (evt == HPACK_EVT_VALUE && fld->flg & HPACK_FLG_VAL_PRE) {
+		sz = hpack_precoded_size(str, len);
+		EXPECT(ctx, ARG, sz > 0);
+		HPE_bcat(ctx, str + len + 1 + HPACK_PRE_HDR, sz);
+		return (0);
+	}
+
+	/* NB: Preset values were validated and their automatic coding was
+	 * picked beforehand, so either the plain value or its Huffman coding
+	 * is copied. Only a Huffman coding the preset didn't keep because it
+	 * wasn't shorter is still encoded here.
+	 */
+	pst = evt == HPACK_EVT_VALUE ? ctx->arg.enc->pst : NULL;
+	hv = pst != NULL ? hpack_preset_lookup(pst, str, len) : NULL;
+	if (hv != NULL && (aut || !huf || hv->huf)) {
+		buf = (const char *)(pst->val + pst->msk + 1) + hv->off;
+		if (hv->huf && (aut || huf)) {
+			HPI_encode(ctx, HPACK_PFX_HUF, HPACK_PAT_HUF,
+			    hv->enc_sz);
+			HPE_bcat(ctx, buf + len, hv->enc_sz);
+		}
+		else {
+			HPI_encode(ctx, HPACK_PFX_STR, HPACK_PAT_STR,
+			    (uint16_t)len);
+			HPE_bcat(ctx, buf, len);
+		}
+		return (0);
 	}
+
+	CALL(val, ctx, str, len);
+
+	if (huf != 0 || aut != 0)
+		CALL(hpack_encode_huffman, ctx, str, len, aut);
 	else {
 		HPI_encode(ctx, HPACK_PFX_STR, HPACK_PAT_STR, (uint16_t)len);
 		HPE_bcat(ctx, str, len);
@@ -1020,12 +2100,6 @@ hpack_encode_dynamic(HPACK_CTX, HPACK_FLD)
 		ctx->fld.nam = hf.nam;
 		ctx->fld.nam_sz = hf.nam_sz;
 	}
-	else {
-		ctx->fld.nam = fld->nam;
-		ctx->fld.nam_sz = strlen(fld->nam);
-	}
-	ctx->fld.val = fld->val;
-	ctx->fld.val_sz = strlen(fld->val);
 	HPT_index(ctx);
 
 	return (0);
@@ -1108,32 +2182,60 @@ hpack_encode_update(HPACK_CTX, ssize_t lim)
 	return (0);
 }
 
+static void
+hpack_field_strings(HPACK_CTX, HPACK_FLD)
+{
+
+	/* NB: The strings of a field are measured once and for all. */
+	ctx->fld.nam = fld->nam;
+	ctx->fld.val = fld->val;
+	if (fld->flg & HPACK_FLG_STR_LEN) {
+		ctx->fld.nam_sz = fld->nam_len;
+		ctx->fld.val_sz = fld->val_len;
+		return;
+	}
+	ctx->fld.nam_sz = fld->nam != NULL ? strlen(fld->nam) : 0;
+	ctx->fld.val_sz = fld->val != NULL ? strlen(fld->val) : 0;
+}
+
 static int
 hpack_auto_index(HPACK_CTX, struct hpack_field *fld)
 {
+	struct hpt_field hf;
 	enum hpack_result_e res;
-	const char *val;
-	uint16_t idx;
+	unsigned nvr;
 
 	if (fld->flg & HPACK_FLG_TYP_IDX || fld->flg & HPACK_FLG_NAM_IDX)
 		return (0); /* NB: ignore auto index */
 
-	val = fld->flg & HPACK_FLG_TYP_NVR ? NULL : fld->val;
+	nvr = fld->flg & HPACK_FLG_TYP_NVR;
+	if (fld->nam == NULL || (!nvr && fld->val == NULL))
+		return (HPACK_RES_ARG);
+
 	fld->idx = 0;
 	fld->nam_idx = 0;
 
-	res = hpack_search(ctx->hp, &idx, fld->nam, val);
-	if (res == HPACK_RES_ARG)
-		return (HPACK_RES_ARG);
-	else if (res == HPACK_RES_NAM) {
+	if (ctx->fld.nam_sz > UINT16_MAX || ctx->fld.val_sz > UINT16_MAX)
+		return (0); /* NB: too long to be indexed anyway */
+
+	hf.nam = ctx->fld.nam;
+	hf.nam_sz = (uint16_t)ctx->fld.nam_sz;
+	hf.val = nvr ? "" : ctx->fld.val;
+	hf.val_sz = nvr ? 0 : (uint16_t)ctx->fld.val_sz;
+	hf.idx = 0;
+
+	res = HPT_search(ctx, &hf);
+	if (res == HPACK_RES_OK && nvr)
+		res = HPACK_RES_NAM;
+
+	if (res == HPACK_RES_NAM) {
 		fld->flg |= HPACK_FLG_NAM_IDX;
-		fld->nam_idx = idx;
+		fld->nam_idx = hf.idx;
 	}
 	else if (res == HPACK_RES_OK) {
-		assert(!(fld->flg & HPACK_FLG_TYP_NVR));
 		fld->flg &= ~HPACK_FLG(TYP_MSK);
 		fld->flg |= HPACK_FLG_TYP_IDX;
-		fld->idx = idx;
+		fld->idx = hf.idx;
 	}
 	else if (res != HPACK_RES_IDX)
 		WRONG("Unexpected result");
@@ -1141,19 +2243,12 @@ hpack_auto_index(HPACK_CTX, struct hpack_field *fld)
 	return (0);
 }
 
-enum hpack_result_e
-hpack_encode(struct hpack *hp, const struct hpack_encoding *enc)
+static void
+hpack_encode_begin(struct hpack *hp, const struct hpack_encoding *enc)
 {
-	struct hpack_field *fld;
 	struct hpack_ctx *ctx;
-	size_t cnt;
 	int retval;
 
-	if (hp == NULL || hp->magic != ENCODER_MAGIC || enc == NULL ||
-	    enc->fld == NULL || enc->fld_cnt == 0 || enc->buf == NULL ||
-	    enc->buf_len == 0 || enc->cb == NULL)
-		return (HPACK_RES_ARG);
-
 	ctx = &hp->ctx;
 	assert(ctx->hp == hp);
 
@@ -1171,6 +2266,7 @@ hpack_encode(struct hpack *hp, const struct hpack_encoding *enc)
 	ctx->ptr_len = 0;
 	ctx->cb = enc->cb;
 	ctx->priv = enc->priv;
+	ctx->ign = enc->ign;
 
 	if (ctx->flg & HPACK_CTX_CAN_UPD && hp->sz.min >= 0) {
 		assert(hp->sz.min <= hp->sz.nxt);
@@ -1194,14 +2290,23 @@ hpack_encode(struct hpack *hp, const struct hpack_encoding *enc)
 	}
 
 	ctx->flg &= ~HPACK_CTX_CAN_UPD;
-	cnt = enc->fld_cnt;
-	fld = enc->fld;
+	(void)retval;
+}
+
+static enum hpack_result_e
+hpack_encode_list(struct hpack *hp, struct hpack_field *fld, size_t cnt)
+{
+	struct hpack_ctx *ctx;
+	int retval;
+
+	ctx = &hp->ctx;
 
 	while (cnt > 0) {
+		hpack_field_strings(ctx, fld);
 		if (fld->flg & HPACK_FLG_AUT_IDX) {
 			retval = hpack_auto_index(ctx, fld);
 			if (retval == HPACK_RES_ARG)
-				return (retval);
+				return (HPACK_RES_ARG);
 			assert(retval == 0);
 		}
 		HPC_notify(ctx, HPACK_EVT_FIELD, NULL, 0);
@@ -1229,15 +2334,376 @@ hpack_encode(struct hpack *hp, const struct hpack_encoding *enc)
 		cnt--;
 	}
 
+	return (HPACK_RES_BLK);
+}
+
+static enum hpack_result_e
+hpack_encode_end(struct hpack *hp)
+{
+	struct hpack_ctx *ctx;
+
+	ctx = &hp->ctx;
 	HPE_send(ctx);
 
 	assert(ctx->res == HPACK_RES_BLK);
-	if (!enc->cut)
+	if (!ctx->arg.enc->cut)
 		ctx->res = HPACK_RES_OK;
 
 	return (ctx->res);
 }
 
+enum hpack_result_e
+hpack_encode(struct hpack *hp, const struct hpack_encoding *enc)
+{
+	enum hpack_result_e res;
+
+	if (hp == NULL || hp->magic != ENCODER_MAGIC || enc == NULL ||
+	    enc->fld == NULL || enc->fld_cnt == 0 || enc->buf == NULL ||
+	    enc->buf_len == 0 || enc->cb == NULL ||
+	    (enc->pst != NULL && enc->pst->magic != PRESET_MAGIC))
+		return (HPACK_RES_ARG);
+
+	hpack_encode_begin(hp, enc);
+	res = hpack_encode_list(hp, enc->fld, enc->fld_cnt);
+	if (res != HPACK_RES_BLK)
+		return (res);
+	return (hpack_encode_end(hp));
+}
+
+/**********************************************************************
+ * Templates
+ */
+
+static void
+hpack_template_cb(enum hpack_event_e evt, const char *buf, size_t len,
+    void *priv)
+{
+	struct hpack_template *tpl;
+
+	if (evt != HPACK_EVT_DATA)
+		return;
+
+	tpl = priv;
+	if (tpl->blk != NULL)
+		(void)memcpy(tpl->blk + tpl->blk_len, buf, len);
+	tpl->blk_len += len;
+}
+
+static void
+hpack_template_dep(struct hpack_template *tpl, uint16_t idx)
+{
+
+	if (idx > HPACK_STATIC && (size_t)(idx - HPACK_STATIC) > tpl->dep)
+		tpl->dep = (size_t)(idx - HPACK_STATIC);
+}
+
+static enum hpack_result_e
+hpack_template_block(struct hpack *hp, const struct hpack_field *src,
+    size_t cnt, struct hpack_template *tpl)
+{
+	struct hpack_encoding enc;
+	struct hpack_field fld;
+	struct hpack_ctx ctx;
+	uint8_t buf[64];
+	int retval;
+
+	/* NB: The block is encoded with a standalone context, the table is
+	 * searched but never modified.
+	 */
+	(void)memset(&enc, 0, sizeof enc);
+	enc.buf = buf;
+	enc.buf_len = sizeof buf;
+	enc.cb = hpack_template_cb;
+	enc.priv = tpl;
+
+	(void)memset(&ctx, 0, sizeof ctx);
+	ctx.hp = hp;
+	ctx.arg.enc = &enc;
+	ctx.ptr.cur = buf;
+	ctx.cb = enc.cb;
+	ctx.priv = tpl;
+	ctx.res = HPACK_RES_BLK;
+
+	tpl->blk_len = 0;
+	tpl->dep = 0;
+	tpl->dyn = 0;
+	tpl->fix = 0;
+
+	while (cnt > 0) {
+		fld = *src;
+		hpack_field_strings(&ctx, &fld);
+		if (fld.flg & HPACK_FLG_AUT_IDX &&
+		    hpack_auto_index(&ctx, &fld) != 0)
+			return (HPACK_RES_ARG);
+		/* NB: Replaying an insertion would desynchronize the
+		 * tables, so fields not found in the dynamic table are
+		 * only inserted by the fallback.
+		 */
+		switch (fld.flg & HPACK_FLG_TYP_MSK) {
+		case HPACK_FLG_TYP_IDX:
+			retval = hpack_encode_indexed(&ctx, &fld);
+			if (retval == 0)
+				hpack_template_dep(tpl, fld.idx);
+			break;
+		case HPACK_FLG_TYP_DYN:
+			tpl->dyn++;
+			if (~src->flg & HPACK_FLG_AUT_IDX ||
+			    src->flg & HPACK_FLG_NAM_IDX)
+				tpl->fix++;
+			retval = hpack_encode_literal(&ctx, &fld);
+			break;
+		case HPACK_FLG_TYP_LIT:
+			retval = hpack_encode_literal(&ctx, &fld);
+			break;
+		case HPACK_FLG_TYP_NVR:
+			retval = hpack_encode_never(&ctx, &fld);
+			break;
+		default:
+			return (HPACK_RES_ARG);
+		}
+		if (retval != 0) {
+			assert(ctx.res != HPACK_RES_OK);
+			assert(ctx.res != HPACK_RES_BLK);
+			return (ctx.res);
+		}
+		if (~fld.flg & HPACK_FLG_TYP_IDX &&
+		    fld.flg & HPACK_FLG_NAM_IDX)
+			hpack_template_dep(tpl, fld.nam_idx);
+		src++;
+		cnt--;
+	}
+
+	HPE_send(&ctx);
+	return (HPACK_RES_OK);
+}
+
+static size_t
+hpack_template_strings(const struct hpack_field *fld, size_t *nam_len,
+    size_t *val_len)
+{
+	size_t len;
+
+	*nam_len = 0;
+	*val_len = 0;
+	len = 0;
+
+	if (~fld->flg & HPACK_FLG_NAM_IDX && fld->nam != NULL) {
+		*nam_len = fld->flg & HPACK_FLG_STR_LEN ?
+		    fld->nam_len : strlen(fld->nam);
+		len += *nam_len + 1;
+	}
+
+	if (~fld->flg & HPACK_FLG_TYP_IDX && fld->val != NULL) {
+		*val_len = fld->flg & HPACK_FLG_STR_LEN ?
+		    fld->val_len : strlen(fld->val);
+		len += *val_len + 1;
+		if (fld->flg & HPACK_FLG_VAL_PRE)
+			len += HPACK_PRE_HDR +
+			    hpack_precoded_size(fld->val, *val_len);
+	}
+
+	return (len);
+}
+
+static enum hpack_result_e
+hpack_template_compile(struct hpack *hp, struct hpack_template *tpl)
+{
+	struct hpack_template tmp;
+	enum hpack_result_e res;
+	uint8_t *blk;
+
+	/* NB: The block is encoded once to measure it, and then once more
+	 * in the template itself.
+	 */
+	(void)memset(&tmp, 0, sizeof tmp);
+	res = hpack_template_block(hp, tpl->fld, tpl->fld_cnt, &tmp);
+	if (res != HPACK_RES_OK)
+		return (res);
+
+	if (tmp.blk_len > tpl->blk_sz) {
+		blk = tpl->alloc.malloc(tmp.blk_len, tpl->alloc.priv);
+		if (blk == NULL)
+			return (HPACK_RES_OOM);
+		if (tpl->blk != NULL)
+			tpl->alloc.free(tpl->blk, tpl->alloc.priv);
+		tpl->blk = blk;
+		tpl->blk_sz = tmp.blk_len;
+	}
+
+	res = hpack_template_block(hp, tpl->fld, tpl->fld_cnt, tpl);
+	assert(res == HPACK_RES_OK);
+	assert(tpl->blk_len == tmp.blk_len);
+	assert(tpl->dep == tmp.dep);
+	tpl->ins = hp->ins;
+	return (HPACK_RES_OK);
+}
+
+enum hpack_result_e
+hpack_template(struct hpack *hp, const struct hpack_field *fld, size_t cnt,
+    struct hpack_template **tplp)
+{
+	struct hpack_template tmp, *tpl;
+	struct hpack_field *dst;
+	enum hpack_result_e res;
+	size_t i, len, nam_len, val_len;
+	char *str;
+
+	if (hp == NULL || hp->magic != ENCODER_MAGIC ||
+	    hp->alloc.free == NULL || fld == NULL || cnt == 0 ||
+	    tplp == NULL)
+		return (HPACK_RES_ARG);
+
+	(void)memset(&tmp, 0, sizeof tmp);
+	res = hpack_template_block(hp, fld, cnt, &tmp);
+	if (res != HPACK_RES_OK)
+		return (res);
+
+	len = sizeof *tpl + 2 * cnt * sizeof *dst;
+	for (i = 0; i < cnt; i++) {
+		len += hpack_template_strings(fld + i, &nam_len, &val_len);
+		if (fld[i].flg & HPACK_FLG_VAL_PRE && fld[i].val != NULL &&
+		    hpack_precoded_size(fld[i].val, val_len) == 0)
+			return (HPACK_RES_ARG);
+	}
+
+	tpl = hp->alloc.malloc(len, hp->alloc.priv);
+	if (tpl == NULL)
+		return (HPACK_RES_OOM);
+
+	(void)memset(tpl, 0, sizeof *tpl);
+	tpl->magic = TEMPLATE_MAGIC;
+	(void)memcpy(&tpl->alloc, &hp->alloc, sizeof hp->alloc);
+	tpl->fld = (struct hpack_field *)(tpl + 1);
+	tpl->cpy = tpl->fld + cnt;
+	tpl->fld_cnt = cnt;
+
+	/* NB: The fields are kept for the fallback and recompilations,
+	 * with copies of their strings.
+	 */
+	str = (char *)(tpl->cpy + cnt);
+	for (i = 0; i < cnt; i++) {
+		dst = &tpl->fld[i];
+		*dst = fld[i];
+		(void)hpack_template_strings(dst, &nam_len, &val_len);
+		if (~dst->flg & HPACK_FLG_NAM_IDX && dst->nam != NULL) {
+			(void)memcpy(str, dst->nam, nam_len);
+			str[nam_len] = '\0';
+			dst->nam = str;
+			str += nam_len + 1;
+		}
+		if (~dst->flg & HPACK_FLG_TYP_IDX && dst->val != NULL) {
+			(void)memcpy(str, dst->val, val_len);
+			str[val_len] = '\0';
+			len = 0;
+			if (dst->flg & HPACK_FLG_VAL_PRE) {
+				len = HPACK_PRE_HDR +
+				    hpack_precoded_size(dst->val, val_len);
+				(void)memcpy(str + val_len + 1,
+				    dst->val + val_len + 1, len);
+			}
+			dst->val = str;
+			str += val_len + 1 + len;
+		}
+		dst->flg |= HPACK_FLG_STR_LEN;
+		dst->nam_len = nam_len;
+		dst->val_len = val_len;
+	}
+
+	res = hpack_template_compile(hp, tpl);
+	if (res != HPACK_RES_OK) {
+		hpack_template_free(&tpl);
+		return (res);
+	}
+
+	*tplp = tpl;
+	return (HPACK_RES_OK);
+}
+
+enum hpack_result_e
+hpack_encode_template(struct hpack *hp, struct hpack_template *tpl,
+    const struct hpack_encoding *enc)
+{
+	enum hpack_result_e res;
+	uint64_t ins;
+	size_t dyn;
+
+	if (hp == NULL || hp->magic != ENCODER_MAGIC || tpl == NULL ||
+	    tpl->magic != TEMPLATE_MAGIC || enc == NULL || enc->buf == NULL ||
+	    enc->buf_len == 0 || enc->cb == NULL ||
+	    (enc->pst != NULL && enc->pst->magic != PRESET_MAGIC))
+		return (HPACK_RES_ARG);
+
+	hpack_encode_begin(hp, enc);
+
+	/* NB: Dynamic indexes are relative to the last insertion, so the
+	 * block is still current if nothing was inserted since it was
+	 * compiled, and the entries it references weren't evicted. Fields
+	 * left as literals in the block still need to be inserted by the
+	 * fallback.
+	 */
+	if (tpl->dyn == 0 &&
+	    (tpl->dep == 0 || (tpl->ins == hp->ins && tpl->dep <= hp->cnt))) {
+		HPE_bcat(&hp->ctx, tpl->blk, tpl->blk_len);
+		return (hpack_encode_end(hp));
+	}
+
+	/* NB: Automatic indexing updates fields, so a copy is encoded. */
+	ins = hp->ins;
+	(void)memcpy(tpl->cpy, tpl->fld, tpl->fld_cnt * sizeof *tpl->fld);
+	res = hpack_encode_list(hp, tpl->cpy, tpl->fld_cnt);
+	if (res != HPACK_RES_BLK)
+		return (res);
+
+	/* NB: Once the fallback is taken the block stays stale until it
+	 * is compiled again against the updated table. A block without
+	 * fields to insert only needs its indexes updated. Otherwise it is
+	 * only worth compiling when the fallback inserted fields, unless
+	 * the last compilation failed to reduce the number of fields left
+	 * to insert, for example when the template's own insertions evict
+	 * its entries. In that case, the template waits for a change in
+	 * the table coming from another block. Templates with fields
+	 * inserted every time are never current. A failed compilation
+	 * leaves the stale block in place and the next use retries.
+	 */
+	if (tpl->stk && tpl->stk_ins != ins)
+		tpl->stk = 0;
+	else if (tpl->stk)
+		tpl->stk_ins = hp->ins; /* skip the fallback's insertions */
+
+	dyn = tpl->dyn;
+	if (tpl->fix == 0 && (dyn == 0 || (hp->ins != ins && !tpl->stk)) &&
+	    hpack_template_compile(hp, tpl) == HPACK_RES_OK &&
+	    dyn > 0 && tpl->dyn >= dyn) {
+		tpl->stk = 1;
+		tpl->stk_ins = hp->ins;
+	}
+
+	return (hpack_encode_end(hp));
+}
+
+void
+hpack_template_free(struct hpack_template **tplp)
+{
+	struct hpack_template *tpl;
+
+	if (tplp == NULL)
+		return;
+
+	tpl = *tplp;
+	if (tpl == NULL)
+		return;
+
+	*tplp = NULL;
+	if (tpl->magic != TEMPLATE_MAGIC)
+		return;
+
+	tpl->magic = 0;
+	assert(tpl->alloc.free != NULL);
+	if (tpl->blk != NULL)
+		tpl->alloc.free(tpl->blk, tpl->alloc.priv);
+	tpl->alloc.free(tpl, tpl->alloc.priv);
+}
+
 enum hpack_result_e
 hpack_clean_field(struct hpack_field *fld)
 {
@@ -1261,6 +2727,9 @@ hpack_clean_field(struct hpack_field *fld)
 		fld->val = NULL;
 		fld->flg &= ~HPACK_FLG(NAM_HUF);
 		fld->flg &= ~HPACK_FLG(VAL_HUF);
+		fld->flg &= ~HPACK_FLG(NAM_AUT);
+		fld->flg &= ~HPACK_FLG(VAL_AUT);
+		fld->flg &= ~HPACK_FLG(VAL_PRE);
 		break;
 	default:
 		return (HPACK_RES_ARG);
@@ -1268,6 +2737,12 @@ hpack_clean_field(struct hpack_field *fld)
 
 	fld->flg &= ~HPACK_FLG(TYP_MSK);
 
+	if (fld->flg & HPACK_FLG(STR_LEN)) {
+		fld->nam_len = 0;
+		fld->val_len = 0;
+		fld->flg &= ~HPACK_FLG(STR_LEN);
+	}
+
 	if (fld->flg & HPACK_FLG(AUT_IDX)) {
 		fld->nam = NULL;
 		fld->val = NULL;
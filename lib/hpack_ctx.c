@@ -35,10 +35,12 @@
 #include "hpack_priv.h"
 
 void
-HPC_notify(HPACK_CTX, enum hpack_event_e evt, const void *buf, size_t len)
+HPC_event(HPACK_CTX, enum hpack_event_e evt, const void *buf, size_t len)
 {
 	if (ctx->flg & HPACK_CTX_TOO_BIG)
 		assert(ctx->hp->magic == DECODER_MAGIC);
+	else if (ctx->cb == NULL) /* decoding a list or discarding */
+		assert(ctx->lst != NULL || ctx->flg & HPACK_CTX_DSC);
 	else
 		ctx->cb(evt, buf, len, ctx->priv);
 }
@@ -38,39 +38,119 @@
 #include "hpack.h"
 #include "hpack_priv.h"
 
+static const char *
+hpd_base(HPACK_CTX)
+{
+
+	if (ctx->seg != NULL)
+		return (ctx->seg->buf);
+	return (ctx->arg.dec->buf);
+}
+
+static unsigned
+hpd_copied(HPACK_CTX, const char *str)
+{
+	const char *buf;
+
+	buf = hpd_base(ctx);
+	return (str != NULL && str >= buf && str <= ctx->buf);
+}
+
+static int
+hpd_grow(HPACK_CTX, const char *bgn, size_t len)
+{
+	struct hpd_segment *seg;
+	struct hpack *hp;
+	size_t fld_len, sz;
+
+	/* NB: The field being decoded moves to a new segment, and previous
+	 * fields stay where they are. Segments are at least as large as the
+	 * previous one to limit the number of allocations.
+	 */
+	hp = ctx->hp;
+	fld_len = (size_t)(ctx->buf - bgn);
+	sz = ctx->seg != NULL ? ctx->seg->len : ctx->arg.dec->buf_len;
+	if (sz < fld_len + len)
+		sz = fld_len + len;
+
+	seg = hp->alloc.malloc(sizeof *seg + sz, hp->alloc.priv);
+	EXPECT(ctx, OOM, seg != NULL);
+	seg->magic = HPD_SEGMENT_MAGIC;
+	seg->nxt = ctx->seg;
+	seg->len = sz;
+	(void)memcpy(seg->buf, bgn, fld_len);
+
+	if (hpd_copied(ctx, ctx->fld.nam))
+		ctx->fld.nam = seg->buf + (ctx->fld.nam - bgn);
+	if (hpd_copied(ctx, ctx->fld.val))
+		ctx->fld.val = seg->buf + (ctx->fld.val - bgn);
+
+	ctx->seg = seg;
+	ctx->buf = seg->buf + fld_len;
+	ctx->buf_len = sz - fld_len;
+
+	return (0);
+}
+
 static int
 hpd_skip(HPACK_CTX, size_t len)
 {
-	size_t fld_len;
+	const char *bgn;
+	size_t fld_len, sft;
 
 	if (ctx->buf_len >= len)
 		return (0);
 
+	/* NB: Only strings decoded in the buffer need to move, a string may
+	 * also reference the block or the dynamic table.
+	 */
+	assert(ctx->fld.nam != NULL);
+	bgn = ctx->buf;
+	if (hpd_copied(ctx, ctx->fld.val))
+		bgn = ctx->fld.val;
+	if (hpd_copied(ctx, ctx->fld.nam))
+		bgn = ctx->fld.nam;
+
+	if (ctx->arg.dec->flg & HPACK_DEC_GRW && ctx->hp->alloc.free != NULL)
+		return (hpd_grow(ctx, bgn, len));
+
+	assert(ctx->seg == NULL);
 	ctx->flg |= HPACK_CTX_TOO_BIG;
-	EXPECT(ctx, BIG, ctx->fld.nam != ctx->arg.dec->buf);
 
-	assert(ctx->fld.nam != NULL);
-	assert(ctx->fld.nam <= ctx->buf);
-	if (ctx->fld.val != NULL)
-		assert(ctx->fld.val <= ctx->buf);
-	fld_len = (size_t)(ctx->buf - ctx->fld.nam);
+	EXPECT(ctx, BIG, bgn != ctx->arg.dec->buf);
+	fld_len = (size_t)(ctx->buf - bgn);
+	sft = (size_t)(bgn - (const char *)ctx->arg.dec->buf);
 
 	EXPECT(ctx, BIG, ctx->arg.dec->buf_len >= len + fld_len);
 
-	memmove(ctx->arg.dec->buf, ctx->fld.nam, fld_len);
+	memmove(ctx->arg.dec->buf, bgn, fld_len);
+
+	if (hpd_copied(ctx, ctx->fld.nam))
+		ctx->fld.nam -= sft;
+	if (hpd_copied(ctx, ctx->fld.val))
+		ctx->fld.val -= sft;
 
 	ctx->buf = ctx->arg.dec->buf;
 	ctx->buf += fld_len;
 	ctx->buf_len = ctx->arg.dec->buf_len - fld_len;
 
-	ctx->fld.nam = ctx->arg.dec->buf;
-	if (ctx->fld.val != NULL)
-		ctx->fld.val = ctx->fld.nam + ctx->fld.nam_sz + 1;
-	assert((ssize_t)fld_len == ctx->buf - ctx->fld.nam);
-
 	return (0);
 }
 
+void
+HPD_release(HPACK_CTX)
+{
+	struct hpd_segment *seg;
+
+	while (ctx->seg != NULL) {
+		seg = ctx->seg;
+		assert(seg->magic == HPD_SEGMENT_MAGIC);
+		ctx->seg = seg->nxt;
+		assert(ctx->hp->alloc.free != NULL);
+		ctx->hp->alloc.free(seg, ctx->hp->alloc.priv);
+	}
+}
+
 int
 HPD_putc(HPACK_CTX, char c)
 {
@@ -101,6 +181,63 @@ HPD_cat(HPACK_CTX, const char *str, size_t len)
 	return (0);
 }
 
+int
+HPD_copy(HPACK_CTX, struct hpack_str_state *hs, const char *str, size_t len)
+{
+
+	CALL(hpd_skip, ctx, len);
+
+	/* NB: The string is classified before it is copied, to validate it
+	 * without reading the decoded copy again.
+	 */
+	hs->cls = HPV_class(hs->cls, str, len);
+	(void)memcpy(ctx->buf, str, len);
+	ctx->buf += len;
+	ctx->buf_len -= len;
+	return (0);
+}
+
+static void
+hpd_list(HPACK_CTX)
+{
+	struct hpack_field *fld;
+	uint8_t typ;
+
+	if (ctx->lst_cnt == ctx->lst_len) {
+		/* skip the rest of the header list */
+		ctx->flg |= HPACK_CTX_TOO_BIG;
+		return;
+	}
+
+	fld = &ctx->lst[ctx->lst_cnt];
+	(void)memset(fld, 0, sizeof *fld);
+	fld->flg = HPACK_FLG_STR_LEN;
+	fld->nam = ctx->fld.nam;
+	fld->val = ctx->fld.val;
+	fld->nam_len = ctx->fld.nam_sz;
+	fld->val_len = ctx->fld.val_sz;
+
+	typ = ctx->hp->state.typ;
+	if ((typ & HPACK_PAT_IDX) == HPACK_PAT_IDX) {
+		fld->flg |= HPACK_FLG_TYP_IDX;
+		fld->idx = ctx->hp->state.idx;
+	}
+	else {
+		if ((typ & HPACK_PAT_DYN) == HPACK_PAT_DYN)
+			fld->flg |= HPACK_FLG_TYP_DYN;
+		else if ((typ & HPACK_PAT_NVR) == HPACK_PAT_NVR)
+			fld->flg |= HPACK_FLG_TYP_NVR;
+		else
+			fld->flg |= HPACK_FLG_TYP_LIT;
+		if (ctx->hp->state.idx > 0) {
+			fld->flg |= HPACK_FLG_NAM_IDX;
+			fld->nam_idx = ctx->hp->state.idx;
+		}
+	}
+
+	ctx->lst_cnt++;
+}
+
 void
 HPD_notify(HPACK_CTX)
 {
@@ -108,9 +245,26 @@ HPD_notify(HPACK_CTX)
 	assert(ctx->fld.nam != NULL);
 	assert(ctx->fld.val != NULL);
 	assert(ctx->fld.nam_sz > 0);
-	assert(ctx->fld.nam[ctx->fld.nam_sz] == '\0');
-	assert(ctx->fld.val[ctx->fld.val_sz] == '\0');
+	assert(ctx->flg & HPACK_CTX_REF ||
+	    ctx->fld.nam[ctx->fld.nam_sz] == '\0');
+	assert(ctx->flg & HPACK_CTX_REF ||
+	    ctx->fld.val[ctx->fld.val_sz] == '\0');
+
+	if (ctx->lst != NULL) {
+		if (~ctx->flg & HPACK_CTX_TOO_BIG)
+			hpd_list(ctx);
+		return;
+	}
 
 	HPC_notify(ctx, HPACK_EVT_NAME,  ctx->fld.nam, ctx->fld.nam_sz);
 	HPC_notify(ctx, HPACK_EVT_VALUE, ctx->fld.val, ctx->fld.val_sz);
 }
+
+void
+HPD_data(HPACK_CTX, const char *str, size_t len)
+{
+
+	assert(ctx->flg & HPACK_CTX_STM);
+	if (len > 0)
+		HPC_notify(ctx, HPACK_EVT_DATA, str, len);
+}
@@ -52,22 +52,48 @@ HPE_putb(HPACK_CTX, uint8_t b)
 		HPE_send(ctx);
 }
 
+void
+HPE_putw(HPACK_CTX, uint32_t w)
+{
+
+	assert(ctx->ptr_len < ctx->arg.enc->buf_len);
+
+	/* fall back to single bytes near the end of the buffer */
+	if (ctx->arg.enc->buf_len - ctx->ptr_len <= 4) {
+		HPE_putb(ctx, (uint8_t)(w >> 24));
+		HPE_putb(ctx, (uint8_t)(w >> 16));
+		HPE_putb(ctx, (uint8_t)(w >> 8));
+		HPE_putb(ctx, (uint8_t)w);
+		return;
+	}
+
+	ctx->ptr.cur[0] = (uint8_t)(w >> 24);
+	ctx->ptr.cur[1] = (uint8_t)(w >> 16);
+	ctx->ptr.cur[2] = (uint8_t)(w >> 8);
+	ctx->ptr.cur[3] = (uint8_t)w;
+	ctx->ptr.cur += 4;
+	ctx->ptr_len += 4;
+}
+
 void
 HPE_bcat(HPACK_CTX, const void *buf, size_t len)
 {
+	const uint8_t *ptr;
 	size_t sz;
 
 	assert(buf != NULL);
 
+	ptr = buf;
 	while (len > 0) {
 		assert(ctx->arg.enc->buf_len > ctx->ptr_len);
 		sz = ctx->arg.enc->buf_len - ctx->ptr_len;
 		if (sz > len)
 			sz = len;
 
-		(void)memcpy(ctx->ptr.cur, buf, sz);
+		(void)memcpy(ctx->ptr.cur, ptr, sz);
 		ctx->ptr.cur += sz;
 		ctx->ptr_len += sz;
+		ptr += sz;
 		len -= sz;
 
 		if (ctx->ptr_len == ctx->arg.enc->buf_len)
@@ -79,7 +105,10 @@ void
 HPE_send(HPACK_CTX)
 {
 
-	if (ctx->ptr_len == 0)
+	/* NB: A context without a callback writes to a buffer sized for
+	 * what it encodes, and never flushes it.
+	 */
+	if (ctx->ptr_len == 0 || ctx->cb == NULL)
 		return;
 
 	HPC_notify(ctx, HPACK_EVT_DATA, ctx->arg.enc->buf, ctx->ptr_len);
@@ -45,109 +45,318 @@
  * Decode
  */
 
+#define HPH_BUFSZ	64
+
 static int
-hph_decode_lookup(HPACK_CTX, int *eos)
+hph_decode_long(uint64_t bits, unsigned blen, unsigned *len)
 {
-	struct hpack_state *hs;
-	uint8_t cod;
+	const struct hph_len *hl;
+	uint32_t cod;
+	unsigned l;
 
-	hs = &ctx->hp->state;
+	/* NB: Codes of the same length are consecutive, so a code is found
+	 * by its offset from the first code of its length.
+	 */
+	for (l = HPH_LUT_BITS + 1; l <= HPH_MAX_BITS && l <= blen; l++) {
+		hl = &hph_len[l];
+		cod = (uint32_t)(bits >> (64 - l));
+		if (cod - hl->fst < hl->cnt) {
+			*len = l;
+			return (hph_sym[hl->off + cod - hl->fst]);
+		}
+	}
+	return (-1); /* more bits needed */
+}
 
-	assert(hs->stt.str.blen >= 8);
-	while (hs->stt.str.blen >= hs->stt.str.oct->len) {
-		cod = (hs->stt.str.bits >> (16 - hs->stt.str.dec->len)) &
-		    0xff;
+int
+HPH_decode(HPACK_CTX, struct hpack_str_state *str, size_t len)
+{
+	const struct hph_lut *lut;
+	char buf[HPH_BUFSZ], *dst;
+	uint64_t bits;
+	size_t cap, max, sz;
+	unsigned blen, n, stm;
+	uint8_t cls;
+	int sym;
 
-		/* premature EOS */
-		EXPECT(ctx, HUF, hs->stt.str.oct[cod].len > 0);
+	bits = str->bits;
+	blen = str->blen;
+	cls = str->cls;
+	sz = 0;
+	stm = ctx->flg & HPACK_CTX_STM;
 
-		if (hs->stt.str.blen < hs->stt.str.oct[cod].len)
-			break; /* more bits needed */
+	if (len > ctx->ptr_len)
+		len = ctx->ptr_len;
 
-		*eos = 1;
-		hs->stt.str.dec = hs->stt.str.oct[cod].nxt;
-		if (hs->stt.str.dec == NULL) {
-			CALL(HPD_putc, ctx, hs->stt.str.oct[cod].chr);
-			hs->stt.str.dec = &hph_dec0;
-			*eos = 0;
+	/* NB: The shortest code is 5 bits long, which bounds the number of
+	 * symbols left in the string. When the buffer can hold all of them
+	 * and the null terminator, they are decoded in place. Otherwise they
+	 * go through a local buffer and the buffer is checked for each
+	 * batch. A streamed string is decoded in chunks sent as data, using
+	 * the buffer as scratch space when it is larger than the local one.
+	 * A chunk is only sent once all its symbols were validated.
+	 */
+	max = (blen + len * 8) / 5 + 1;
+	cap = HPH_BUFSZ;
+	dst = buf;
+	if (stm && ctx->buf_len > HPH_BUFSZ) {
+		cap = ctx->buf_len;
+		dst = ctx->buf;
+	}
+	else if (!stm && ctx->buf_len >= max) {
+		cap = 0;
+		dst = ctx->buf;
+	}
+
+	/* NB: The bits are aligned left and refilled to fit the longest code
+	 * plus a byte. The bits of an incomplete code are kept in the state
+	 * to resume with the next partial block. Symbols are also classified
+	 * for validation.
+	 */
+	while (1) {
+		while (blen <= 56 && str->len > 0 && len > 0) {
+			bits |= (uint64_t)*ctx->ptr.blk << (56 - blen);
+			blen += 8;
+			str->len--;
+			ctx->ptr.blk++;
+			ctx->ptr_len--;
+			len--;
 		}
 
-		hs->stt.str.blen -= hs->stt.str.oct[cod].len;
-		hs->stt.str.bits <<= hs->stt.str.oct[cod].len;
-		hs->stt.str.oct = hs->stt.str.dec->oct;
+		if (cap > 0 && sz > cap - 2) {
+			if (stm) {
+				EXPECT(ctx, CHR, cls != 0);
+				HPD_data(ctx, dst, sz);
+			}
+			else
+				CALL(HPD_cat, ctx, buf, sz);
+			sz = 0;
+		}
+
+		lut = &hph_lut[bits >> (64 - HPH_LUT_BITS)];
+		if (lut->cnt == 0) {
+			sym = hph_decode_long(bits, blen, &n);
+			if (sym < 0)
+				break;
+			/* premature EOS */
+			EXPECT(ctx, HUF, sym != HPH_EOS);
+			cls &= HPV_cls[sym];
+			dst[sz++] = (char)sym;
+		}
+		else if (lut->len[0] <= blen) {
+			cls &= HPV_cls[(uint8_t)lut->chr[0]];
+			dst[sz++] = lut->chr[0];
+			n = lut->len[0];
+			if (lut->cnt == 2 && lut->len[1] <= blen) {
+				cls &= HPV_cls[(uint8_t)lut->chr[1]];
+				dst[sz++] = lut->chr[1];
+				n = lut->len[1];
+			}
+		}
+		else
+			break; /* more bits needed */
+
+		bits <<= n;
+		blen -= n;
+	}
+
+	str->bits = bits;
+	str->blen = (uint8_t)blen;
+	str->cls = cls;
+	if (stm) {
+		EXPECT(ctx, CHR, cls != 0);
+		HPD_data(ctx, dst, sz);
 	}
+	else if (dst != buf) {
+		assert(sz < max);
+		ctx->buf += sz;
+		ctx->buf_len -= sz;
+	}
+	else if (sz > 0)
+		CALL(HPD_cat, ctx, buf, sz);
+
+	EXPECT(ctx, BUF, str->len == 0);
+
+	/* spurious EOS */
+	EXPECT(ctx, HUF, blen < 8);
+
+	/* check padding */
+	EXPECT(ctx, HUF, bits == ~(UINT64_MAX >> blen));
+
+	if (!stm)
+		CALL(HPD_putc, ctx, '\0');
+
 	return (0);
 }
 
+/**********************************************************************
+ * Cache
+ */
+
 int
-HPH_decode(HPACK_CTX, size_t len)
+HPH_decode_cached(HPACK_CTX, struct hpack_str_state *str, size_t len)
 {
-	struct hpack_state *hs;
-	int eos;
+	struct hph_cache *hc;
+	struct hph_entry *he;
+	const char *raw;
+	char *slot;
+	size_t sz;
+	unsigned i;
+
+	/* NB: Values are looked up when they start and are entirely in the
+	 * block. Short values are cheap enough to decode that they would only
+	 * evict longer ones.
+	 */
+	hc = ctx->hp->cch;
+	if (hc == NULL || len < HPH_CACHE_MIN || len > ctx->ptr_len ||
+	    ctx->flg & HPACK_CTX_STM)
+		return (HPH_decode(ctx, str, len));
 
-	hs = &ctx->hp->state;
-	eos = 0;
+	assert(hc->magic == HPH_CACHE_MAGIC);
+	assert(str->len == len);
+	assert(str->blen == 0);
+	raw = (const char *)ctx->ptr.blk;
 
-	if (hs->stt.str.dec == NULL) {
-		hs->stt.str.dec = &hph_dec0;
-		hs->stt.str.oct = hph_oct0;
+	for (i = 0, he = hc->ent; i < HPH_CACHE_SLOTS; i++, he++) {
+		slot = hc->buf + i * hc->len;
+		if (he->raw_sz != len || memcmp(slot, raw, len))
+			continue;
+		CALL(HPD_puts, ctx, slot + len, he->val_sz);
+		str->cls &= he->cls;
+		str->len = 0;
+		ctx->ptr.blk += len;
+		ctx->ptr_len -= len;
+		return (0);
 	}
 
-	if (len > ctx->ptr_len)
-		len = ctx->ptr_len;
+	CALL(HPH_decode, ctx, str, len);
 
-	while (hs->stt.str.len > 0) {
-		EXPECT(ctx, BUF, len > 0);
-		assert(hs->stt.str.blen < 8);
-		hs->stt.str.bits |= *ctx->ptr.blk << (8 - hs->stt.str.blen);
-		hs->stt.str.blen += 8;
-		hs->stt.str.len--;
-		ctx->ptr.blk++;
-		ctx->ptr_len--;
-		len--;
+	/* NB: The value may have moved in the buffer, but its location is
+	 * kept up to date in the field.
+	 */
+	sz = (size_t)(ctx->buf - ctx->fld.val);
+	if (len + sz > hc->len)
+		return (0);
+
+	i = hc->nxt;
+	hc->nxt = (i + 1) % HPH_CACHE_SLOTS;
+	he = &hc->ent[i];
+	slot = hc->buf + i * hc->len;
+	(void)memcpy(slot, raw, len);
+	(void)memcpy(slot + len, ctx->fld.val, sz);
+	he->raw_sz = len;
+	he->val_sz = sz - 1;
+	he->cls = str->cls;
+	return (0);
+}
+
+static size_t
+hph_bits(const char *str, size_t len)
+{
+	size_t sz;
+
+	assert(str != NULL);
 
-		CALL(hph_decode_lookup, ctx, &eos);
+	sz = 0;
+
+	while (len > 0) {
+		sz += hph_enc[(uint8_t)*str].len;
+		str++;
+		len--;
 	}
 
-	EXPECT(ctx, HUF, eos == 0); /* spurious EOS */
+	return (sz);
+}
+
+void
+HPH_encode(HPACK_CTX, const char *str, size_t len)
+{
+	struct hph_state hs;
+
+	hs.str = str;
+	hs.len = len;
+	hs.bits = 0;
+	hs.sz = 0;
+	HPH_resume(ctx, &hs);
+}
+
+size_t
+HPH_fill(struct hph_state *hs, uint8_t *buf, size_t len)
+{
+	size_t off;
+	uint8_t c;
+
+	assert(hs->sz < 32);
+	off = 0;
+
+	/* NB: A character is only consumed when its code and the pending
+	 * bits fit in the remaining octets, so the encoding can resume where
+	 * it stopped once the buffer is flushed.
+	 */
+	while (hs->len > 0) {
+		c = (uint8_t)*hs->str;
+		if (off + ((hs->sz + hph_enc[c].len) >> 3) > len)
+			return (off);
 
-	if (hs->stt.str.blen > 0) {
-		/* check padding */
-		assert(hs->stt.str.blen < 8);
-		EXPECT(ctx, HUF, hs->stt.str.bits ==
-		    (uint16_t)(0xffff << (16 - hs->stt.str.blen)));
+		hs->bits = (hs->bits << hph_enc[c].len) | hph_enc[c].cod;
+		hs->sz += hph_enc[c].len;
+		hs->str++;
+		hs->len--;
+
+		if (hs->sz >= 32) {
+			hs->sz -= 32;
+			buf[off++] = (uint8_t)(hs->bits >> (hs->sz + 24));
+			buf[off++] = (uint8_t)(hs->bits >> (hs->sz + 16));
+			buf[off++] = (uint8_t)(hs->bits >> (hs->sz + 8));
+			buf[off++] = (uint8_t)(hs->bits >> hs->sz);
+		}
 	}
-	else {
-		/* no padding */
-		assert(hs->stt.str.bits == 0);
+
+	while (hs->sz >= 8) {
+		hs->sz -= 8;
+		buf[off++] = (uint8_t)(hs->bits >> hs->sz);
 	}
 
-	CALL(HPD_putc, ctx, '\0');
+	if (hs->sz > 0 && off < len) {
+		buf[off++] = (uint8_t)((hs->bits << (8 - hs->sz)) |
+		    ((1U << (8 - hs->sz)) - 1));
+		hs->sz = 0;
+	}
 
-	return (0);
+	return (off);
 }
 
 void
-HPH_encode(HPACK_CTX, const char *str)
+HPH_resume(HPACK_CTX, struct hph_state *hs)
 {
 	uint64_t bits;
 	size_t sz;
 	uint8_t c;
 
-	bits = 0;
-	sz = 0;
+	assert(hs->sz < 32);
+	bits = hs->bits;
+	sz = hs->sz;
 
-	while (*str != '\0') {
-		c = (uint8_t)*str;
+	/* NB: Codes are at most 30 bits long, so the accumulator always has
+	 * room for one more code before a 32-bit word is flushed.
+	 */
+	while (hs->len > 0) {
+		c = (uint8_t)*hs->str;
 		bits = (bits << hph_enc[c].len) | hph_enc[c].cod;
 		sz += hph_enc[c].len;
 
-		while (sz >= 8) {
-			sz -= 8;
-			HPE_putb(ctx, (uint8_t)(bits >> sz));
+		if (sz >= 32) {
+			sz -= 32;
+			HPE_putw(ctx, (uint32_t)(bits >> sz));
 		}
 
-		str++;
+		hs->str++;
+		hs->len--;
+	}
+
+	while (sz >= 8) {
+		sz -= 8;
+		HPE_putb(ctx, (uint8_t)(bits >> sz));
 	}
 
 	assert(sz < 8);
@@ -157,21 +366,50 @@ HPH_encode(HPACK_CTX, const char *str)
 		bits |= (1 << sz) - 1;
 		HPE_putb(ctx, (uint8_t)bits);
 	}
+
+	hs->bits = 0;
+	hs->sz = 0;
 }
 
 size_t
-HPH_size(const char *str)
+HPH_pending(const struct hph_state *hs)
 {
-	size_t sz;
+
+	assert(hs->sz < 32);
+	return ((hs->sz + hph_bits(hs->str, hs->len) + 7) >> 3);
+}
+
+size_t
+HPH_size(const char *str, size_t len)
+{
+
+	return ((hph_bits(str, len) + 7) >> 3);
+}
+
+size_t
+HPH_shrink(const char *str, size_t len)
+{
+	size_t bits, max;
 
 	assert(str != NULL);
 
-	sz = 7;
+	if (len == 0)
+		return (0);
 
-	while (*str != '\0') {
-		sz += hph_enc[(uint8_t)*str].len;
+	/* NB: Shorter means at least one octet less, padding included, and
+	 * since codes are at least 5 bits long, a string is rejected as soon
+	 * as the remaining characters can't save enough bits.
+	 */
+	bits = 0;
+	max = (len - 1) << 3;
+
+	while (len > 0) {
+		bits += hph_enc[(uint8_t)*str].len;
 		str++;
+		len--;
+		if (bits + 5 * len > max)
+			return (max / 8 + 1);
 	}
 
-	return (sz >> 3);
+	return ((bits + 7) >> 3);
 }
@@ -118,3 +118,25 @@ HPI_encode(HPACK_CTX, enum hpi_prefix_e pfx, enum hpi_pattern_e pat,
 
 	HPE_putb(ctx, (uint8_t)val);
 }
+
+size_t
+HPI_size(enum hpi_prefix_e pfx, uint16_t val)
+{
+	uint8_t mask;
+	size_t sz;
+
+	assert(pfx >= 4 && pfx <= 7);
+
+	mask = (uint8_t)((1 << pfx) - 1);
+	if (val < mask)
+		return (1);
+
+	sz = 2;
+	val -= mask;
+	while (val >= 0x80) {
+		val >>= 7;
+		sz++;
+	}
+
+	return (sz);
+}
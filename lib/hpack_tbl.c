@@ -59,40 +59,260 @@ static const struct hpt_field hpt_static[] = {
 };
 
 /**********************************************************************
- * Tables lookups
+ * Ring buffer
  */
 
 static struct hpt_entry *
-hpt_dynamic(struct hpack *hp, size_t idx)
+hpt_read(const struct hpack *hp, size_t off, struct hpt_entry *tmp)
 {
-	struct hpt_entry *he, tmp;
-	size_t off;
+	struct hpt_entry *he;
 
-	he = hp->tbl;
-	off = 0;
+	assert(off + HPACK_OVERHEAD < hp->sz.mem);
+	he = MOVE(hp->tbl, off);
+	(void)memcpy(tmp, he, HPT_HEADERSZ);
+	assert(tmp->magic == HPT_ENTRY_MAGIC);
+	assert(tmp->nam_sz > 0);
+	return (he);
+}
+
+/**********************************************************************
+ * Directory
+ */
+
+#define HPT_FNV_BASIS	0x811c9dc5
+#define HPT_FNV_PRIME	0x01000193
+
+static uint32_t
+hpt_hash(uint32_t hsh, const char *str, size_t len)
+{
+
+	/* FNV-1a */
+	while (len > 0) {
+		hsh ^= (uint8_t)*str;
+		hsh *= HPT_FNV_PRIME;
+		str++;
+		len--;
+	}
+	return (hsh);
+}
+
+static size_t
+hpt_age(const struct hpack *hp, size_t slot)
+{
+
+	assert(slot < hp->dir.cap);
+	return ((slot + hp->dir.cap - hp->dir.bgn) % hp->dir.cap);
+}
+
+static size_t
+hpt_slot(const struct hpack *hp, size_t idx)
+{
 
 	assert(idx > 0);
 	assert(idx <= hp->cnt);
+	return ((hp->dir.bgn + hp->cnt - idx) % hp->dir.cap);
+}
 
-	while (1) {
-		(void)memcpy(&tmp, he, HPT_HEADERSZ);
-		assert(tmp.magic == HPT_ENTRY_MAGIC);
-		assert(tmp.pre_sz == off);
-		assert(tmp.nam_sz > 0);
-		if (--idx == 0)
-			return (he);
-		off = HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
-		he = MOVE(he, off);
+static void
+hpt_link(struct hpack *hp, size_t slot, const char *nam, const char *val)
+{
+	struct hpack_dir *dir;
+	uint32_t hsh;
+	size_t bkt;
+
+	dir = &hp->dir;
+	hsh = hpt_hash(HPT_FNV_BASIS, nam, dir->nam_sz[slot]);
+	bkt = hsh % dir->cap;
+	dir->nam_hsh[slot] = hsh;
+	dir->nam_nxt[slot] = dir->nam_bkt[bkt];
+	dir->nam_bkt[bkt] = (uint16_t)(slot + 1);
+
+	hsh = hpt_hash(hsh, val, dir->val_sz[slot]);
+	bkt = hsh % dir->cap;
+	dir->fld_hsh[slot] = hsh;
+	dir->fld_nxt[slot] = dir->fld_bkt[bkt];
+	dir->fld_bkt[bkt] = (uint16_t)(slot + 1);
+}
+
+static uint16_t
+hpt_next(const struct hpack *hp, const uint32_t *hsh, const uint16_t *nxt,
+    uint32_t key, uint16_t lnk, size_t *age)
+{
+	size_t slot, tmp;
+
+	while (lnk > 0) {
+		slot = lnk - 1u;
+		tmp = hpt_age(hp, slot);
+		if (tmp >= *age || hsh[slot] % hp->dir.cap != key % hp->dir.cap)
+			return (0); /* evicted or reused slot */
+		*age = tmp;
+		if (hsh[slot] == key)
+			return (lnk);
+		lnk = nxt[slot];
+	}
+	return (0);
+}
+
+static void
+hpt_rebuild(struct hpack *hp)
+{
+	struct hpack_dir *dir;
+	struct hpt_entry *he, tmp;
+	size_t i, off, cap;
+
+	dir = &hp->dir;
+	cap = HPT_SLOTS(hp->sz.mem);
+	dir->cap = cap;
+	dir->nam_hsh = MOVE(hp->tbl, HPT_DIROFF(hp->sz.mem));
+	dir->fld_hsh = dir->nam_hsh + cap;
+	dir->off = (uint16_t *)(dir->fld_hsh + cap);
+	dir->nam_sz = dir->off + cap;
+	dir->val_sz = dir->nam_sz + cap;
+	dir->nam_nxt = dir->val_sz + cap;
+	dir->fld_nxt = dir->nam_nxt + cap;
+	dir->nam_bkt = dir->fld_nxt + cap;
+	dir->fld_bkt = dir->nam_bkt + cap;
+	dir->bgn = 0;
+	assert(hp->cnt < cap);
+
+	(void)memset(dir->nam_bkt, 0, 2 * cap * sizeof *dir->nam_bkt);
+
+	off = hp->rng.bgn;
+	for (i = 0; i < hp->cnt; i++) {
+		if (off == hp->rng.wrp)
+			off = 0;
+		he = hpt_read(hp, off, &tmp);
+		dir->off[i] = (uint16_t)off;
+		dir->nam_sz[i] = tmp.nam_sz;
+		dir->val_sz[i] = tmp.val_sz;
+		hpt_link(hp, i, JUMP(he, 0), JUMP(he, tmp.nam_sz + 1));
+		off += HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
 	}
+
+	assert(off == hp->rng.end);
+}
+
+void
+HPT_rebuild(HPACK_CTX)
+{
+
+	hpt_rebuild(ctx->hp);
+}
+
+/**********************************************************************
+ * Compaction
+ */
+
+static void
+hpt_reverse(uint8_t *bgn, uint8_t *end)
+{
+	uint8_t tmp;
+
+	while (bgn < end) {
+		end--;
+		tmp = *bgn;
+		*bgn = *end;
+		*end = tmp;
+		bgn++;
+	}
+}
+
+static void
+hpt_rotate(struct hpack *hp, size_t bgn, size_t end, size_t sft,
+    const char **ptr)
+{
+	uint8_t *tbl;
+	size_t len, off;
+
+	assert(bgn <= end);
+	assert(end <= hp->sz.mem);
+
+	len = end - bgn;
+	assert(sft <= len);
+	if (sft == 0 || sft == len)
+		return;
+
+	tbl = (uint8_t *)hp->tbl;
+	hpt_reverse(tbl + bgn, tbl + bgn + sft);
+	hpt_reverse(tbl + bgn + sft, tbl + end);
+	hpt_reverse(tbl + bgn, tbl + end);
+
+	if (ptr == NULL || *ptr < (const char *)tbl + bgn ||
+	    *ptr >= (const char *)tbl + end)
+		return;
+
+	/* keep track of a name moved along with the table contents */
+	off = (size_t)(*ptr - (const char *)tbl) - bgn;
+	off = (off + len - sft) % len;
+	*ptr = (const char *)tbl + bgn + off;
+}
+
+static void
+hpt_compact(struct hpack *hp, const char **ptr)
+{
+	struct hpack_ring *rng;
+	size_t mem, gap;
+
+	/* NB: Rotations preserve every single byte of the table, including
+	 * the contents of evicted entries. This is how a name referenced by
+	 * a new entry is kept around until it is copied.
+	 */
+	rng = &hp->rng;
+	mem = hp->sz.mem;
+	if (hp->cnt == 0) {
+		assert(rng->bgn == 0);
+		assert(rng->end == 0);
+		return;
+	}
+
+	hpt_rotate(hp, 0, mem, rng->bgn, ptr);
+
+	if (rng->wrp == 0)
+		rng->end -= rng->bgn;
+	else {
+		/* close the gap left at the end of the buffer */
+		assert(rng->end <= rng->bgn);
+		gap = mem - rng->wrp;
+		hpt_rotate(hp, rng->wrp - rng->bgn, mem - rng->bgn + rng->end,
+		    gap, ptr);
+		rng->end += rng->wrp - rng->bgn;
+	}
+
+	rng->bgn = 0;
+	rng->wrp = 0;
+	assert(rng->end == hp->sz.len);
+	hpt_rebuild(hp);
+}
+
+void
+HPT_compact(HPACK_CTX)
+{
+
+	hpt_compact(ctx->hp, NULL);
+}
+
+/**********************************************************************
+ * Tables lookups
+ */
+
+static void
+hpt_dynamic(const struct hpack *hp, size_t slot, struct hpt_field *hf)
+{
+	const struct hpt_entry *he;
+
+	he = MOVE(hp->tbl, hp->dir.off[slot]);
+	hf->nam_sz = hp->dir.nam_sz[slot];
+	hf->val_sz = hp->dir.val_sz[slot];
+	hf->nam = JUMP(he, 0);
+	hf->val = JUMP(he, hf->nam_sz + 1);
 }
 
 int
 HPT_field(HPACK_CTX, size_t idx, struct hpt_field *hf)
 {
-	const struct hpt_entry *he;
-	struct hpt_entry tmp;
 
 	assert(idx != 0);
+	assert(hf != NULL);
 	if (idx <= HPACK_STATIC) {
 		(void)memcpy(hf, &hpt_static[idx - 1], sizeof *hf);
 		return (0);
@@ -101,24 +321,16 @@ HPT_field(HPACK_CTX, size_t idx, struct hpt_field *hf)
 	idx -= HPACK_STATIC;
 	EXPECT(ctx, IDX, idx <= ctx->hp->cnt);
 
-	he = hpt_dynamic(ctx->hp, idx);
-	assert(he != NULL);
-	assert(hf != NULL);
-	(void)memcpy(&tmp, he, HPT_HEADERSZ);
-	hf->nam_sz = tmp.nam_sz;
-	hf->val_sz = tmp.val_sz;
-	hf->nam = JUMP(he, 0);
-	hf->val = JUMP(he, tmp.nam_sz + 1);
+	hpt_dynamic(ctx->hp, hpt_slot(ctx->hp, idx), hf);
 	return (0);
 }
 
 void
 HPT_foreach(HPACK_CTX, int flg)
 {
-	const struct hpt_entry *he, *tbl;
 	const struct hpt_field *hf;
-	struct hpt_entry tmp;
-	size_t i, off;
+	struct hpt_field tmp;
+	size_t i, sz, len;
 
 	if (flg & HPT_FLG_STATIC)
 		for (i = 0, hf = hpt_static; i < HPACK_STATIC; i++, hf++) {
@@ -130,111 +342,126 @@ HPT_foreach(HPACK_CTX, int flg)
 	if (~flg & HPT_FLG_DYNAMIC)
 		return;
 
-	off = 0;
-	tbl = ctx->hp->tbl;
-	he = tbl;
-	for (i = 0; i < ctx->hp->cnt; i++) {
-		assert(DIFF(tbl, he) < ctx->hp->sz.len);
-		(void)memcpy(&tmp, he, HPT_HEADERSZ);
-		assert(tmp.magic == HPT_ENTRY_MAGIC);
-		assert(tmp.pre_sz == off);
-		assert(tmp.nam_sz > 0);
-		off = HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
-		HPC_notify(ctx, HPACK_EVT_FIELD, NULL, off);
-		HPC_notify(ctx, HPACK_EVT_NAME, JUMP(he, 0), tmp.nam_sz);
-		HPC_notify(ctx, HPACK_EVT_VALUE, JUMP(he, tmp.nam_sz + 1),
-		    tmp.val_sz);
-		he = MOVE(he, off);
+	len = 0;
+	for (i = 1; i <= ctx->hp->cnt; i++) {
+		hpt_dynamic(ctx->hp, hpt_slot(ctx->hp, i), &tmp);
+		sz = HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
+		HPC_notify(ctx, HPACK_EVT_FIELD, NULL, sz);
+		HPC_notify(ctx, HPACK_EVT_NAME, tmp.nam, tmp.nam_sz);
+		HPC_notify(ctx, HPACK_EVT_VALUE, tmp.val, tmp.val_sz);
+		len += sz;
 	}
 
-	assert(DIFF(tbl, he) == ctx->hp->sz.len);
+	assert(len == ctx->hp->sz.len);
 }
 
 static int
-hpt_bsearch(struct hpt_field *key, const struct hpt_field *src,
-    size_t len)
+hpt_ssearch(struct hpt_field *hf, size_t nam_sz, size_t val_sz)
 {
-	size_t min, max, pos;
-	int retval, cmp;
-
-	retval = HPACK_RES_IDX;
-	min = 0;
-	max = len - 1;
-
-	while (min <= max) {
-		pos = (min + max) / 2;
-		cmp = strcmp(key->nam, src[pos].nam);
-		if (!cmp) {
-			retval = HPACK_RES_NAM;
-			key->idx = src[pos].idx;
-			cmp = strcmp(key->val, src[pos].val);
-			if (!cmp) {
-				retval = HPACK_RES_OK;
-				break;
-			}
+	const struct hpt_field *sf;
+	const uint8_t *bkt;
+	size_t i;
+
+	/* NB: The static table is indexed by a generated perfect hash of
+	 * the names, and entries sharing a name are contiguous.
+	 */
+	if (nam_sz == 0)
+		return (HPACK_RES_IDX);
+
+	bkt = hpack_static_hash[HPS_HASH(hf->nam, nam_sz)];
+	if (bkt[0] == 0)
+		return (HPACK_RES_IDX);
+
+	sf = &hpt_static[bkt[0] - 1];
+	if (sf->nam_sz != nam_sz || memcmp(hf->nam, sf->nam, nam_sz))
+		return (HPACK_RES_IDX);
+
+	hf->idx = sf->idx;
+	for (i = 0; i < bkt[1]; i++, sf++)
+		if (sf->val_sz == val_sz && !memcmp(hf->val, sf->val, val_sz)) {
+			hf->idx = sf->idx;
+			return (HPACK_RES_OK);
 		}
-		if (cmp < 0)
-			max = pos - 1;
-		else
-			min = pos + 1;
+
+	return (HPACK_RES_NAM);
+}
+
+static int
+hpt_dsearch(const struct hpack *hp, struct hpt_field *hf, size_t nam_sz,
+    size_t val_sz)
+{
+	const struct hpack_dir *dir;
+	struct hpt_field tmp;
+	size_t age;
+	uint32_t nam_hsh, fld_hsh;
+	uint16_t lnk;
+
+	/* NB: Candidates are only compared when the hash of the field or
+	 * the name is a match, starting with the newest entries. An empty
+	 * chain is a miss.
+	 */
+	dir = &hp->dir;
+	nam_hsh = hpt_hash(HPT_FNV_BASIS, hf->nam, nam_sz);
+	fld_hsh = hpt_hash(nam_hsh, hf->val, val_sz);
+
+	age = hp->cnt;
+	lnk = dir->fld_bkt[fld_hsh % dir->cap];
+	while ((lnk = hpt_next(hp, dir->fld_hsh, dir->fld_nxt, fld_hsh, lnk,
+	    &age)) > 0) {
+		hpt_dynamic(hp, lnk - 1u, &tmp);
+		if (tmp.nam_sz == nam_sz && tmp.val_sz == val_sz &&
+		    !memcmp(hf->nam, tmp.nam, nam_sz) &&
+		    !memcmp(hf->val, tmp.val, val_sz)) {
+			hf->idx = (uint16_t)(HPACK_STATIC + hp->cnt - age);
+			return (HPACK_RES_OK);
+		}
+		lnk = dir->fld_nxt[lnk - 1u];
 	}
 
-	return (retval);
+	age = hp->cnt;
+	lnk = dir->nam_bkt[nam_hsh % dir->cap];
+	while ((lnk = hpt_next(hp, dir->nam_hsh, dir->nam_nxt, nam_hsh, lnk,
+	    &age)) > 0) {
+		hpt_dynamic(hp, lnk - 1u, &tmp);
+		if (tmp.nam_sz == nam_sz && !memcmp(hf->nam, tmp.nam, nam_sz)) {
+			hf->idx = (uint16_t)(HPACK_STATIC + hp->cnt - age);
+			return (HPACK_RES_NAM);
+		}
+		lnk = dir->nam_nxt[lnk - 1u];
+	}
+
+	return (HPACK_RES_IDX);
 }
 
 int
 HPT_search(HPACK_CTX, struct hpt_field *hf)
 {
-	const struct hpt_entry *he, *tbl;
-	struct hpt_entry tmp;
-	uint16_t i, nam_idx;
-	size_t off;
+	size_t nam_sz, val_sz;
+	uint16_t nam_idx;
 	int retval;
 
 	assert(ctx != NULL);
 	assert(hf != NULL);
-	retval = HPACK_RES_IDX;
 
-	if (*hf->nam == ':')
-		retval = hpt_bsearch(hf, hpt_static, HPS_PSEUDO);
-	else
-		retval = hpt_bsearch(hf, hpack_static_hdr, HPS_NORMAL);
+	nam_sz = hf->nam_sz;
+	val_sz = hf->val_sz;
+	retval = hpt_ssearch(hf, nam_sz, val_sz);
 
 	if (retval != HPACK_RES_IDX) {
 		assert(hf->idx > 0);
 		assert(hf->idx <= HPACK_STATIC);
 	}
 
-	if (retval == 0)
-		return (0);
-	else
-		nam_idx = hf->idx;
-
-	off = 0;
-	tbl = ctx->hp->tbl;
-	he = tbl;
-	for (i = 0; i < ctx->hp->cnt; i++) {
-		assert(DIFF(tbl, he) < ctx->hp->sz.len);
-		(void)memcpy(&tmp, he, HPT_HEADERSZ);
-		assert(tmp.magic == HPT_ENTRY_MAGIC);
-		assert(tmp.pre_sz == off);
-		assert(tmp.nam_sz > 0);
-		off = HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
-		if (!strcmp(hf->nam, JUMP(he, 0))) {
-			nam_idx = i + HPACK_STATIC + 1;
-			if (!strcmp(hf->val, JUMP(he, tmp.nam_sz + 1))) {
-				hf->idx = nam_idx;
-				return (0);
-			}
-		}
-		he = MOVE(he, off);
-	}
+	if (retval == 0 || ctx->hp->cnt == 0)
+		return (retval);
 
-	assert(DIFF(tbl, he) == ctx->hp->sz.len);
-	hf->idx = nam_idx;
-	if (nam_idx > 0)
-		return (HPACK_RES_NAM);
-	return (HPACK_RES_IDX);
+	nam_idx = retval == HPACK_RES_NAM ? hf->idx : 0;
+	retval = hpt_dsearch(ctx->hp, hf, nam_sz, val_sz);
+	if (retval == HPACK_RES_IDX && nam_idx > 0) {
+		hf->idx = nam_idx;
+		retval = HPACK_RES_NAM;
+	}
+	return (retval);
 }
 
 /**********************************************************************
@@ -245,38 +472,44 @@ void
 HPT_adjust(struct hpack_ctx *ctx, size_t len)
 {
 	struct hpack *hp;
-	struct hpt_entry *he;
-	struct hpt_entry tmp;
-	size_t sz, lim, n;
+	struct hpack_dir *dir;
+	size_t sz, lim, cnt;
 
 	hp = ctx->hp;
+	dir = &hp->dir;
 	assert(hp->sz.lim <= (ssize_t)hp->sz.max ||
 	    hp->sz.nxt > (ssize_t)hp->sz.max);
 
 	if (hp->cnt == 0)
 		return;
 
-	he = hpt_dynamic(hp, hp->cnt);
 	lim = HPACK_LIMIT(hp);
 
-	n = 0;
+	cnt = hp->cnt;
 	while (hp->cnt > 0 && len > lim) {
-		(void)memcpy(&tmp, he, HPT_HEADERSZ);
-		assert(tmp.magic == HPT_ENTRY_MAGIC);
-		assert(tmp.nam_sz > 0);
-		sz = HPACK_OVERHEAD + tmp.nam_sz + tmp.val_sz;
+		assert(dir->off[dir->bgn] == hp->rng.bgn);
+		sz = HPACK_OVERHEAD + dir->nam_sz[dir->bgn] +
+		    dir->val_sz[dir->bgn];
 		len -= sz;
 		hp->sz.len -= sz;
 		hp->cnt--;
-		he = MOVE(he, -tmp.pre_sz);
-		n++;
+		hp->rng.bgn += sz;
+		if (++dir->bgn == dir->cap)
+			dir->bgn = 0;
+		if (hp->rng.bgn == hp->rng.wrp) {
+			/* the oldest entries wrapped around */
+			hp->rng.bgn = 0;
+			hp->rng.wrp = 0;
+		}
 	}
 
-	if (n > 0)
-		HPC_notify(ctx, HPACK_EVT_EVICT, NULL, n);
+	if (cnt > hp->cnt)
+		HPC_notify(ctx, HPACK_EVT_EVICT, NULL, cnt - hp->cnt);
 
-	if (hp->cnt == 0)
+	if (hp->cnt == 0) {
 		assert(hp->sz.len == 0);
+		(void)memset(&hp->rng, 0, sizeof hp->rng);
+	}
 	else
 		assert(hp->sz.len > 0);
 }
@@ -312,7 +545,7 @@ hpt_overlap(const struct hpack *hp, const char *buf, size_t len)
 
 	bgn = (uintptr_t)hp->tbl;
 	pos = (uintptr_t)buf;
-	end = bgn + hp->sz.len;
+	end = bgn + hp->sz.mem;
 
 	if (pos >= bgn && pos < end) {
 		pos += len;
@@ -325,54 +558,45 @@ hpt_overlap(const struct hpack *hp, const char *buf, size_t len)
 	return (0);
 }
 
-static void
-hpt_move_evicted(HPACK_CTX, const char *nam, size_t nam_sz, size_t len)
+static size_t
+hpt_reserve(HPACK_CTX, size_t len)
 {
 	struct hpack *hp;
-	char tmp[64], *nam_ptr;
-	void *tbl_ptr;
-	size_t sz, mv;
+	struct hpack_ring *rng;
 
 	hp = ctx->hp;
-	assert(hp->magic == ENCODER_MAGIC);
+	rng = &hp->rng;
+	assert(hp->sz.len + len <= hp->sz.mem);
 
-	tbl_ptr = hp->tbl;
-	nam_ptr = JUMP(hp->tbl, 0);
-	nam_sz++; /* null character */
-	mv = 0;
-
-	/* NB: from RFC 7541 section 4.4.
-	 * A new entry can reference the name of an entry in the dynamic table
-	 * that will be evicted when adding this new entry into the dynamic
-	 * table.  Implementations are cautioned to avoid deleting the
-	 * referenced name if the referenced entry is evicted from the dynamic
-	 * table prior to inserting the new entry.
-	 */
-	while (nam_sz > 0) {
-		sz = nam_sz < sizeof tmp ? nam_sz : sizeof tmp;
-		mv += sz;
-
-		(void)memcpy(tmp, nam, sz);
-		(void)memmove(MOVE(tbl_ptr, sz), tbl_ptr, hp->sz.len);
-		(void)memcpy(nam_ptr, tmp, sz);
+	if (hp->cnt == 0)
+		return (0);
 
-		len -= sz;
-		nam += sz;
-		nam_sz -= sz;
-		tbl_ptr = MOVE(tbl_ptr, sz);
+	if (rng->wrp == 0) {
+		if (rng->end + len <= hp->sz.mem)
+			return (rng->end);
+		if (len <= rng->bgn) {
+			rng->wrp = rng->end;
+			return (0);
+		}
 	}
+	else if (rng->end + len <= rng->bgn)
+		return (rng->end);
 
-	assert(len > HPT_HEADERSZ);
-	(void)memmove(MOVE(tbl_ptr, len), tbl_ptr, hp->sz.len);
+	/* NB: The free space is fragmented, the table contents need to be
+	 * moved once in a while. A name referenced by the new entry may
+	 * move along.
+	 */
+	hpt_compact(hp, &ctx->fld.nam);
+	assert(rng->end + len <= hp->sz.mem);
+	return (rng->end);
 }
 
 void
 HPT_index(HPACK_CTX)
 {
 	struct hpack *hp;
-	void *nam_ptr, *val_ptr;
-	size_t len, nam_sz, val_sz;
-	unsigned ovl;
+	struct hpt_entry *he, tmp;
+	size_t len, nam_sz, val_sz, off, slot;
 
 	assert(ctx->fld.nam != NULL);
 	assert(ctx->fld.val != NULL);
@@ -382,36 +606,51 @@ HPT_index(HPACK_CTX)
 	val_sz = ctx->fld.val_sz;
 	assert(nam_sz <= UINT16_MAX);
 	assert(val_sz <= UINT16_MAX);
-	assert(ctx->fld.nam[nam_sz] == '\0');
-	assert(ctx->fld.val[val_sz] == '\0');
 
 	hp = ctx->hp;
-	ovl = hpt_overlap(hp, ctx->fld.nam, nam_sz);
+	if (hpt_overlap(hp, ctx->fld.nam, nam_sz))
+		assert(hp->magic == ENCODER_MAGIC || ctx->flg & HPACK_CTX_REF);
 	assert(!hpt_overlap(hp, ctx->fld.val, val_sz));
 
 	len = HPACK_OVERHEAD + nam_sz + val_sz;
 	if (!hpt_fit(ctx, len))
 		return;
 
-	nam_ptr = JUMP(hp->tbl, 0);
-	val_ptr = JUMP(hp->tbl, nam_sz + 1);
-	hp->tbl->pre_sz = len;
+	off = hpt_reserve(ctx, len);
+	he = MOVE(hp->tbl, off);
 
-	if (ovl)
-		hpt_move_evicted(ctx, ctx->fld.nam, nam_sz, len);
-	else if (hp->cnt > 0)
-		(void)memmove(MOVE(hp->tbl, len), hp->tbl, hp->sz.len);
-
-	if (!ovl)
-		(void)memcpy(nam_ptr, ctx->fld.nam, nam_sz + 1);
-	(void)memcpy(val_ptr, ctx->fld.val, val_sz + 1);
-
-	hp->tbl->magic = HPT_ENTRY_MAGIC;
-	hp->tbl->pre_sz = 0;
-	hp->tbl->nam_sz = (uint16_t)nam_sz;
-	hp->tbl->val_sz = (uint16_t)val_sz;
+	/* NB: from RFC 7541 section 4.4.
+	 * A new entry can reference the name of an entry in the dynamic table
+	 * that will be evicted when adding this new entry into the dynamic
+	 * table.  Implementations are cautioned to avoid deleting the
+	 * referenced name if the referenced entry is evicted from the dynamic
+	 * table prior to inserting the new entry.
+	 *
+	 * Evictions don't clear the table, so the name is copied first, and
+	 * only then may the header overwrite the evicted name. The strings
+	 * given to the encoder may not be null-terminated.
+	 */
+	(void)memmove(JUMP(he, 0), ctx->fld.nam, nam_sz);
+	*(char *)JUMP(he, nam_sz) = '\0';
+	(void)memcpy(JUMP(he, nam_sz + 1), ctx->fld.val, val_sz);
+	*(char *)JUMP(he, nam_sz + val_sz + 1) = '\0';
+
+	(void)memset(&tmp, 0, sizeof tmp);
+	tmp.magic = HPT_ENTRY_MAGIC;
+	tmp.nam_sz = (uint16_t)nam_sz;
+	tmp.val_sz = (uint16_t)val_sz;
+	(void)memcpy(he, &tmp, HPT_HEADERSZ);
+
+	slot = (hp->dir.bgn + hp->cnt) % hp->dir.cap;
+	hp->dir.off[slot] = (uint16_t)off;
+	hp->dir.nam_sz[slot] = (uint16_t)nam_sz;
+	hp->dir.val_sz[slot] = (uint16_t)val_sz;
+	hpt_link(hp, slot, JUMP(he, 0), JUMP(he, nam_sz + 1));
+
+	hp->rng.end = off + len;
 	hp->sz.len += len;
 	hp->cnt++;
+	hp->ins++;
 
 	HPC_notify(ctx, HPACK_EVT_INDEX, NULL, len);
 }
@@ -432,6 +671,16 @@ HPT_decode(HPACK_CTX, size_t idx)
 	assert(hf.val != NULL);
 	assert(hf.nam_sz > 0);
 
+	if (ctx->flg & HPACK_CTX_REF) {
+		/* reference the strings in the table */
+		ctx->fld.nam = hf.nam;
+		ctx->fld.nam_sz = hf.nam_sz;
+		ctx->fld.val = hf.val;
+		ctx->fld.val_sz = hf.val_sz;
+		HPD_notify(ctx);
+		return (0);
+	}
+
 	ctx->fld.nam = ctx->buf;
 	ctx->fld.nam_sz = hf.nam_sz;
 	CALL(HPD_puts, ctx, hf.nam, hf.nam_sz);
@@ -444,6 +693,88 @@ HPT_decode(HPACK_CTX, size_t idx)
 	return (0);
 }
 
+struct hpack_select *
+HPT_select(const struct hpack_alloc *ha, const char * const *sel, size_t len)
+{
+	struct hpack_select *hs;
+	const struct hpt_field *hf;
+	struct hpt_name *hn;
+	char *buf;
+	size_t bkt, i, n, sz;
+
+	sz = 0;
+	for (n = 0; n < len; n++)
+		sz += strlen(sel[n]) + 1;
+
+	hs = ha->malloc(sizeof *hs + len * sizeof *hn + len * sizeof *hs->bkt +
+	    sz, ha->priv);
+	if (hs == NULL)
+		return (NULL);
+
+	hs->magic = HPT_SELECT_MAGIC;
+	hs->msk = 0;
+	hs->cnt = len;
+	hs->bkt = (uint32_t *)(hs->nam + len);
+	(void)memset(hs->bkt, 0, len * sizeof *hs->bkt);
+	buf = (char *)(hs->bkt + len);
+
+	/* NB: The names are copied and indexed by their hash, like names of
+	 * the dynamic table. Static names are resolved once, so that the
+	 * interest of fields with a static name index is a single bit test.
+	 */
+	for (n = 0, hn = hs->nam; n < len; n++, hn++) {
+		sz = strlen(sel[n]);
+		(void)memcpy(buf, sel[n], sz + 1);
+		hn->nam = buf;
+		hn->len = sz;
+		hn->hsh = hpt_hash(HPT_FNV_BASIS, buf, sz);
+		bkt = hn->hsh % len;
+		hn->nxt = hs->bkt[bkt];
+		hs->bkt[bkt] = (uint32_t)(n + 1);
+		buf += sz + 1;
+
+		for (i = 0, hf = hpt_static; i < HPACK_STATIC; i++, hf++)
+			if (hf->nam_sz == sz && !memcmp(hf->nam, hn->nam, sz))
+				hs->msk |= (uint64_t)1 << i;
+	}
+
+	return (hs);
+}
+
+unsigned
+HPT_selected(HPACK_CTX)
+{
+	const struct hpack_select *hs;
+	const struct hpt_name *hn;
+	uint32_t hsh, lnk;
+	uint16_t idx;
+	size_t sz;
+
+	hs = ctx->hp->sel;
+	assert(hs != NULL);
+	assert(hs->magic == HPT_SELECT_MAGIC);
+
+	idx = ctx->hp->state.idx;
+	if (idx > 0 && idx <= HPACK_STATIC)
+		return ((hs->msk >> (idx - 1)) & 1);
+
+	/* NB: Dynamic entries already know the hash of their name. */
+	sz = ctx->fld.nam_sz;
+	if (idx > HPACK_STATIC)
+		hsh = ctx->hp->dir.nam_hsh[hpt_slot(ctx->hp,
+		    idx - HPACK_STATIC)];
+	else
+		hsh = hpt_hash(HPT_FNV_BASIS, ctx->fld.nam, sz);
+
+	for (lnk = hs->bkt[hsh % hs->cnt]; lnk > 0; lnk = hn->nxt) {
+		hn = &hs->nam[lnk - 1];
+		if (hn->hsh == hsh && hn->len == sz &&
+		    !memcmp(hn->nam, ctx->fld.nam, sz))
+			return (1);
+	}
+	return (0);
+}
+
 int
 HPT_decode_name(HPACK_CTX)
 {
@@ -456,5 +787,11 @@ HPT_decode_name(HPACK_CTX)
 	assert(hf.nam != NULL);
 	assert(hf.nam_sz > 0);
 
+	ctx->fld.nam_sz = hf.nam_sz;
+	if (ctx->flg & HPACK_CTX_REF) {
+		ctx->fld.nam = hf.nam;
+		return (0);
+	}
+
 	return (HPD_puts(ctx, hf.nam, hf.nam_sz));
 }
@@ -38,27 +38,96 @@
 #include "hpack.h"
 #include "hpack_priv.h"
 
-#define IS_VCHAR(c)		((uint8_t)c > 0x20 && (uint8_t)c < 0x7f)
-#define IS_OBS_TEXT(c)		((uint8_t)c & 0x80)
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define IS_VCHAR(c)		((c) > 0x20 && (c) < 0x7f)
+#define IS_OBS_TEXT(c)		((c) & 0x80)
 #define IS_FIELD_VCHAR(c)	(IS_VCHAR(c) || IS_OBS_TEXT(c))
-#define IS_FIELD_VALUE(c)	(c == ' ' || c == '\t' || IS_FIELD_VCHAR(c))
+#define IS_FIELD_VALUE(c)	((c) == ' ' || (c) == '\t' || IS_FIELD_VCHAR(c))
 
-int
-HPV_value(HPACK_CTX, const char *str, size_t len)
+/* RFC 7230 Section 3.2.6.  Field Value Components */
+#define IS_DELIMITER(c)							\
+	((c) == '(' || (c) == ')' || (c) == '<' || (c) == '>' ||	\
+	 (c) == '@' || (c) == ',' || (c) == ';' || (c) == ':' ||	\
+	 (c) == '\\' || (c) == '"' || (c) == '/' || (c) == '[' ||	\
+	 (c) == ']' || (c) == '?' || (c) == '=' || (c) == '{' ||	\
+	 (c) == '}')
+
+/* RFC 7540 Section 8.1.2.  HTTP Header Fields */
+#define IS_UPPER(c)		((c) >= 'A' && (c) <= 'Z')
+
+#define IS_TOKEN(c)		(IS_VCHAR(c) && !IS_DELIMITER(c) && !IS_UPPER(c))
+
+#define HPV_C1(c)							\
+	((IS_TOKEN(c) ? HPV_CLS_TOK : 0) | (IS_FIELD_VALUE(c) ? HPV_CLS_VAL : 0))
+#define HPV_C4(c)	HPV_C1(c), HPV_C1(c + 1), HPV_C1(c + 2), HPV_C1(c + 3)
+#define HPV_C16(c)	HPV_C4(c), HPV_C4(c + 4), HPV_C4(c + 8), HPV_C4(c + 12)
+#define HPV_C64(c)	HPV_C16(c), HPV_C16(c + 16), HPV_C16(c + 32), \
+			HPV_C16(c + 48)
+
+const uint8_t HPV_cls[256] = {
+	HPV_C64(0x00), HPV_C64(0x40), HPV_C64(0x80), HPV_C64(0xc0)
+};
+
+#ifdef __SSE2__
+static size_t
+hpv_value_sse2(uint8_t *cls, const char *str, size_t len)
 {
-	uint8_t c;
+	__m128i v, bad, ctl;
+	size_t n;
+
+	/* NB: Octets are compared as signed integers, so obs-text is
+	 * negative and only needs to be excluded from control characters.
+	 */
+	bad = _mm_setzero_si128();
+	for (n = 0; len - n >= 16; n += 16) {
+		v = _mm_loadu_si128((const void *)(str + n));
+		ctl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(-1)),
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(' ')));
+		ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+		    ctl);
+		ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+		bad = _mm_or_si128(bad, ctl);
+	}
+
+	if (_mm_movemask_epi8(bad) != 0)
+		*cls = 0;
+	return (n);
+}
+#endif
+
+uint8_t
+HPV_class(uint8_t cls, const char *str, size_t len)
+{
+	size_t n;
 
 	assert(str != NULL);
-	while (len > 0) {
-		c = (uint8_t)*str;
-		/* RFC 7230 3.2.  Header Fields */
-		EXPECT(ctx, CHR, c == '\t' || (c >= ' ' && c != 0x7f));
-		assert(IS_FIELD_VALUE(c));
-		str++;
-		len--;
+	n = 0;
+
+#ifdef __SSE2__
+	/* NB: Values are checked 16 octets at a time. Tokens are usually
+	 * too short to benefit from it and go through the table.
+	 */
+	if (cls == HPV_CLS_VAL)
+		n = hpv_value_sse2(&cls, str, len);
+#endif
+
+	while (n < len) {
+		cls &= HPV_cls[(uint8_t)str[n]];
+		n++;
 	}
 
-	assert(*str == '\0');
+	return (cls);
+}
+
+int
+HPV_value(HPACK_CTX, const char *str, size_t len)
+{
+
+	/* RFC 7230 3.2.  Header Fields */
+	EXPECT(ctx, CHR, HPV_class(HPV_CLS_VAL, str, len) != 0);
 	return (0);
 }
 
@@ -66,30 +135,48 @@ int
 HPV_token(HPACK_CTX, const char *str, size_t len)
 {
 
+	assert(str != NULL);
+	assert(len > 0);
+	return (HPV_name(ctx, str, len, HPV_class(HPV_CLS_TOK, str, len)));
+}
+
+int
+HPV_name(HPACK_CTX, const char *str, size_t len, uint8_t cls)
+{
+	const char *hdr;
+
 	assert(str != NULL);
 	assert(len > 0);
 
 	/* RFC 7540 Section 8.1.2.1.  Pseudo-Header Fields */
 	if (*str == ':') {
-#define HPPH(hdr)					\
-		if (!strncmp(str, hdr, len + 1))	\
-				return (0);
-#include "tbl/hpack_pseudo_headers.h"
-#undef HPPH
+		/* NB: The length and third character leave at most one
+		 * pseudo-header to compare with.
+		 */
+		switch (len) {
+		case 5:
+			hdr = ":path";
+			break;
+		case 7:
+			if (str[2] == 'e')
+				hdr = ":method";
+			else if (str[2] == 'c')
+				hdr = ":scheme";
+			else
+				hdr = ":status";
+			break;
+		case 10:
+			hdr = ":authority";
+			break;
+		default:
+			hdr = NULL;
+		}
+		if (hdr != NULL && !memcmp(str + 1, hdr + 1, len - 1))
+			return (0);
 		ctx->res = HPACK_RES_HDR;
 		return (HPACK_RES_HDR);
 	}
 
-	while (len > 0) {
-		/* RFC 7230 Section 3.2.6.  Field Value Components */
-		EXPECT(ctx, CHR, IS_VCHAR(*str) &&
-		    strchr("()<>@,;:\\\"/[]?={} ", *str) == NULL);
-		/* RFC 7540 Section 8.1.2.  HTTP Header Fields */
-		EXPECT(ctx, CHR, *str < 'A' || *str > 'Z');
-		str++;
-		len--;
-	}
-
-	assert(*str == '\0');
+	EXPECT(ctx, CHR, cls != 0);
 	return (0);
 }
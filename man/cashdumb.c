@@ -144,6 +144,8 @@ dumb_fields_send(struct hpack *hp, struct dumb_state *stt, unsigned cut)
 	enc.buf_len = sizeof buf;
 	enc.cb = dumb_log_cb;
 	enc.priv = stt;
+	enc.ign = 0;
+	enc.pst = NULL;
 	enc.cut = cut;
 
 	res = hpack_encode(hp, &enc);
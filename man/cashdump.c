@@ -138,6 +138,8 @@ main(int argc, char **argv)
 	dec.buf_len = sizeof buf;
 	dec.cb = print_headers;
 	dec.priv = NULL;
+	dec.ign = 0;
+	dec.flg = 0;
 
 	while (read_block(&frm, sizeof frm) == 1) {
 		if (!first)
@@ -68,7 +68,9 @@ decode_block(void *priv, const void *blk, size_t len, unsigned cut)
 	dec.buf_len = priv2->len;
 	dec.cb = priv2->cb;
 	dec.priv = NULL;
+	dec.ign = 0;
 	dec.cut = cut;
+	dec.flg = 0;
 
 	while ((retval = hpack_decode_fields(priv2->hp, &dec, &priv2->nam,
 	    &priv2->val)) == HPACK_RES_FLD)
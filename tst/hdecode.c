@@ -44,6 +44,10 @@
 
 #include "tst.h"
 
+#ifndef HDECODE_REF
+#define HDECODE_REF 0
+#endif
+
 struct dec_priv {
 	struct hpack	*hp;
 	hpack_event_f	*cb;
@@ -105,7 +109,9 @@ decode_block(void *priv, const void *blk, size_t len, unsigned cut)
 	dec.buf_len = priv2->len;
 	dec.cb = priv2->cb;
 	dec.priv = NULL;
+	dec.ign = 0;
 	dec.cut = cut;
+	dec.flg = HDECODE_REF ? HPACK_DEC_REF : 0;
 
 	retval = hpack_decode(priv2->hp, &dec);
 
@@ -114,6 +114,8 @@ encode_message(struct enc_ctx *ctx)
 	enc.buf_len = sizeof buf;
 	enc.cb = ctx->cb;
 	enc.priv = NULL;
+	enc.ign = 0;
+	enc.pst = NULL;
 	enc.cut = ctx->cut;
 
 	ctx->res = hpack_encode(hp, &enc);
@@ -150,6 +152,14 @@ parse_name(struct hpack_field *fld, const char **args)
 		fld->flg |= HPACK_FLG_NAM_HUF;
 		*args = sp + 1;
 	}
+	else if (!TOKCMP(*args, "aut")) {
+		*args = TOK_ARGS(*args, "aut");
+		sp = strchr(*args, ' ');
+		assert(sp != NULL);
+		fld->nam = strndup(*args, sp - *args);
+		fld->flg |= HPACK_FLG_NAM_AUT;
+		*args = sp + 1;
+	}
 	else if (!TOKCMP(*args, "idx")) {
 		*args = TOK_ARGS(*args, "idx");
 		sp = strchr(*args, ' ');
@@ -182,6 +192,14 @@ parse_value(struct hpack_field *fld, const char **args)
 		fld->flg |= HPACK_FLG_VAL_HUF;
 		*args = ln + 1;
 	}
+	else if (!TOKCMP(*args, "aut")) {
+		*args = TOK_ARGS(*args, "aut");
+		ln = strchr(*args, '\n');
+		assert(ln != NULL);
+		fld->val = strndup(*args, ln - *args);
+		fld->flg |= HPACK_FLG_VAL_AUT;
+		*args = ln + 1;
+	}
 	else
 		WRONG("Unknown token");
 }
@@ -85,6 +85,77 @@ static const uint8_t update_block[] = { 0x20 };
 
 static const uint8_t double_block[] = { 0x82, 0x84 };
 
+static const uint8_t list_block[] = {
+	0x82,				/* :method: GET */
+	0x44, 0x02, '/', 'a',		/* :path: /a */
+	0x10, 0x01, 'x', 0x01, 'y',	/* x: y */
+};
+
+static const uint8_t evict_block[] = {
+	0x40, 0x01, 'a', 0x01, 'b',	/* a: b */
+	0xbe,				/* a: b */
+	0x40, 0x01, 'c', 0x01, 'd',	/* c: d */
+};
+
+static const uint8_t dynamic_block[] = { 0xbe };
+
+static const uint8_t stream_block[] = {
+	0x00, 0x01, 'x', 0x14,		/* x: b{20} */
+	'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b',
+	'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b',
+	0x10, 0x01, 'y', 0x8a,		/* y: a{16} (huffman) */
+	0x18, 0xc6, 0x31, 0x8c, 0x63, 0x18, 0xc6, 0x31, 0x8c, 0x63,
+	0x00, 0x01, 'z', 0x01, 'c',	/* z: c */
+};
+
+static const uint8_t inject_raw_block[] = {
+	0x00, 0x01, 'x', 0x14,		/* x: b{7}\r\ny: b{8} */
+	'b', 'b', 'b', 'b', 'b', 'b', 'b', '\r', '\n', 'y',
+	':', ' ', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b',
+};
+
+static const uint8_t inject_huf_block[] = {
+	0x00, 0x01, 'x', 0x8f,		/* x: a{16}\na{2} (huffman) */
+	0x18, 0xc6, 0x31, 0x8c, 0x63, 0x18, 0xc6, 0x31, 0x8c, 0x63,
+	0xff, 0xff, 0xff, 0xf0, 0x63,
+};
+
+static const uint8_t select_block[] = {
+	0x82,				/* :method: GET */
+	0x04, 0x02, '/', 'a',		/* :path: /a */
+	0x0f, 0x0d, 0x01, '5',		/* content-length: 5 */
+	0x00, 0x01, 'x', 0x01, 'y',	/* x: y */
+	0x00, 0x01, 'z', 0x01, 'w',	/* z: w */
+	0x40, 0x01, 'q', 0x01, 'r',	/* q: r */
+};
+
+static const char * const select_names[] = { ":path", "z" };
+
+static const uint8_t select_dynamic_block[] = {
+	0x0f, 0x2f, 0x01, 's',		/* q: s */
+};
+
+static const uint8_t lazy_block[] = {
+	0x00, 0x01, 'x', 0x85,		/* x: a{8} (huffman) */
+	0x18, 0xc6, 0x31, 0x8c, 0x63,
+	0x00, 0x01, 'y', 0x01, 'z',	/* y: z */
+	0x40, 0x01, 'q', 0x85,		/* q: a{8} (huffman) */
+	0x18, 0xc6, 0x31, 0x8c, 0x63,
+};
+
+static const uint8_t cache_block[] = {
+	0x00, 0x01, 'x', 0x99,		/* x: a{40} (huffman) */
+	0x18, 0xc6, 0x31, 0x8c, 0x63, 0x18, 0xc6, 0x31, 0x8c, 0x63,
+	0x18, 0xc6, 0x31, 0x8c, 0x63, 0x18, 0xc6, 0x31, 0x8c, 0x63,
+	0x18, 0xc6, 0x31, 0x8c, 0x63,
+};
+
+struct stream_priv {
+	unsigned	cnt[HPACK_EVT_RAW + 1];
+	char		val[64];
+	size_t		len;
+};
+
 static struct hpack_field basic_field[] = {{
 	.flg = HPACK_FLG_TYP_IDX,
 	.idx = 1,
@@ -110,6 +181,32 @@ noop_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
 	(void)len;
 }
 
+static void
+count_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
+{
+	unsigned *cnt;
+
+	cnt = priv;
+	cnt[evt]++;
+	(void)buf;
+	(void)len;
+}
+
+static void
+stream_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
+{
+	struct stream_priv *sp;
+
+	sp = priv;
+	sp->cnt[evt]++;
+	if (evt != HPACK_EVT_DATA && evt != HPACK_EVT_RAW)
+		return;
+	assert(buf != NULL);
+	assert(sp->len + len <= sizeof sp->val);
+	(void)memcpy(sp->val + sp->len, buf, len);
+	sp->len += len;
+}
+
 static struct hpack *
 make_decoder(size_t max, ssize_t rsz, const struct hpack_alloc *ha)
 {
@@ -144,7 +241,7 @@ test_dump_cb(void *priv, const char *fmt, ...)
  * Static allocator
  */
 
-static uint8_t static_buffer[1024];
+static uint8_t static_buffer[2048];
 
 static void *
 static_malloc(size_t size, void *priv)
@@ -202,6 +299,30 @@ static const struct hpack_alloc oom_alloc = {
 	NULL
 };
 
+/**********************************************************************
+ * Single allocation allocator
+ */
+
+static unsigned once_cnt;
+
+static void *
+once_malloc(size_t size, void *priv)
+{
+
+	(void)priv;
+	if (once_cnt++ > 0)
+		return (NULL);
+
+	return (malloc(size));
+}
+
+static const struct hpack_alloc once_alloc = {
+	once_malloc,
+	NULL,
+	oom_free,
+	NULL
+};
+
 /**********************************************************************
  * Test cases sharing a bunch of global variables
  */
@@ -220,6 +341,7 @@ static const struct hpack_decoding nam##_decoding = {	\
 	.cb = noop_cb,					\
 	.priv = NULL,					\
 	.cut = 0,					\
+	.flg = 0,					\
 }
 DECODING(update);
 DECODING(junk);
@@ -428,6 +550,499 @@ test_decode_fields_null_args(void)
 	hpack_free(&hp);
 }
 
+static void
+test_decode_list(void)
+{
+	struct hpack_decoding dec;
+	struct hpack_field lst[3];
+	size_t cnt;
+
+	(void)memset(&dec, 0, sizeof dec);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+	cnt = 3;
+
+	/* one NULL per argument and an empty list */
+	CHECK_RES(retval, ARG, hpack_decode_list, NULL, &dec, lst, &cnt);
+	CHECK_RES(retval, ARG, hpack_decode_list, hp,   NULL, lst, &cnt);
+	CHECK_RES(retval, ARG, hpack_decode_list, hp,   &dec, NULL, &cnt);
+	CHECK_RES(retval, ARG, hpack_decode_list, hp,   &dec, lst,  NULL);
+	cnt = 0;
+	CHECK_RES(retval, ARG, hpack_decode_list, hp, &dec, lst, &cnt);
+
+	/* decode the whole list */
+	cnt = 3;
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 3);
+
+	assert(lst[0].flg == (HPACK_FLG_TYP_IDX | HPACK_FLG_STR_LEN));
+	assert(lst[0].idx == 2);
+	assert(lst[0].nam_len == 7 && !strncmp(lst[0].nam, ":method", 7));
+	assert(lst[0].val_len == 3 && !strncmp(lst[0].val, "GET", 3));
+
+	assert(lst[1].flg ==
+	    (HPACK_FLG_TYP_DYN | HPACK_FLG_NAM_IDX | HPACK_FLG_STR_LEN));
+	assert(lst[1].nam_idx == 4);
+	assert(lst[1].nam_len == 5 && !strncmp(lst[1].nam, ":path", 5));
+	assert(lst[1].val_len == 2 && !strncmp(lst[1].val, "/a", 2));
+
+	assert(lst[2].flg == (HPACK_FLG_TYP_NVR | HPACK_FLG_STR_LEN));
+	assert(lst[2].nam_len == 1 && !strncmp(lst[2].nam, "x", 1));
+	assert(lst[2].val_len == 1 && !strncmp(lst[2].val, "y", 1));
+
+	/* the same list in two partial blocks */
+	dec.blk_len = 3;
+	dec.cut = 1;
+	cnt = 3;
+	CHECK_RES(retval, BLK, hpack_decode_list, hp, &dec, lst, &cnt);
+	dec.blk = list_block + 3;
+	dec.blk_len = sizeof list_block - 3;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 3);
+	assert(lst[1].val_len == 2 && !strncmp(lst[1].val, "/a", 2));
+
+	/* a list too small is skipped but still updates the table */
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	cnt = 2;
+	CHECK_RES(retval, SKP, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 0);
+	CHECK_RES(retval, OK, hpack_skip, hp);
+
+	/* callbacks can't take over a partial list */
+	dec.blk_len = 3;
+	dec.cut = 1;
+	cnt = 3;
+	dec.cb = noop_cb;
+	CHECK_RES(retval, BLK, hpack_decode_list, hp, &dec, lst, &cnt);
+	CHECK_RES(retval, ARG, hpack_decode, hp, &dec);
+	hpack_free(&hp);
+
+	/* an indexed field evicted later in the same list */
+	(void)memset(&dec, 0, sizeof dec);
+	hp = make_decoder(64, -1, hpack_default_alloc);
+	dec.blk = evict_block;
+	dec.blk_len = sizeof evict_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+	dec.flg = HPACK_DEC_REF;
+	cnt = 3;
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 3);
+	assert(lst[1].idx == 62);
+	assert(lst[1].nam_len == 1 && !strncmp(lst[1].nam, "a", 1));
+	assert(lst[1].val_len == 1 && !strncmp(lst[1].val, "b", 1));
+	assert(lst[2].nam_len == 1 && !strncmp(lst[2].nam, "c", 1));
+	hpack_free(&hp);
+}
+
+static void
+test_decode_select(void)
+{
+	struct hpack_decoding dec;
+	struct stream_priv sp;
+	const char *sel;
+	char nam[2];
+
+	hp = make_decoder(0, -1, &static_alloc);
+	CHECK_RES(retval, ARG, hpack_select, hp, select_names, 2);
+	hpack_free(&hp);
+
+	(void)memset(&dec, 0, sizeof dec);
+	(void)memset(&sp, 0, sizeof sp);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = select_block;
+	dec.blk_len = sizeof select_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+	dec.cb = stream_cb;
+	dec.priv = &sp;
+
+	/* one NULL per argument and an empty set */
+	CHECK_RES(retval, ARG, hpack_select, NULL, select_names, 2);
+	CHECK_RES(retval, ARG, hpack_select, hp, NULL, 2);
+	CHECK_RES(retval, ARG, hpack_select, hp, select_names, 0);
+	CHECK_RES(retval, OK, hpack_select, hp, select_names, 2);
+
+	/* indexed and inserted fields are always decoded */
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_NAME] == 6);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 4);
+	assert(sp.cnt[HPACK_EVT_RAW] == 2);
+	assert(sp.len == 4);
+	assert(!memcmp(sp.val, "\x01" "5" "\x01" "y", 4));
+
+	/* a raw value spanning two partial blocks */
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk_len = 8;
+	dec.cut = 1;
+	CHECK_RES(retval, BLK, hpack_decode, hp, &dec);
+	CHECK_RES(retval, BSY, hpack_select, hp, NULL, 0);
+	dec.blk = select_block + 8;
+	dec.blk_len = sizeof select_block - 8;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_RAW] == 3);
+	assert(sp.len == 4);
+	assert(!memcmp(sp.val, "\x01" "5" "\x01" "y", 4));
+
+	/* a name of the dynamic table */
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk = select_dynamic_block;
+	dec.blk_len = sizeof select_dynamic_block;
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_NAME] == 1);
+	assert(sp.cnt[HPACK_EVT_RAW] == 1);
+
+	/* the names are copied */
+	(void)memset(&sp, 0, sizeof sp);
+	(void)strcpy(nam, "q");
+	sel = nam;
+	CHECK_RES(retval, OK, hpack_select, hp, &sel, 1);
+	nam[0] = 'x';
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 1);
+	assert(sp.cnt[HPACK_EVT_RAW] == 0);
+
+	/* everything is decoded once the set is cleared */
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk = select_block;
+	dec.blk_len = sizeof select_block;
+	CHECK_RES(retval, OK, hpack_select, hp, NULL, 0);
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 6);
+	assert(sp.cnt[HPACK_EVT_RAW] == 0);
+
+	hpack_free(&hp);
+}
+
+static void
+test_decode_lazy(void)
+{
+	struct hpack_decoding dec;
+	struct stream_priv sp;
+	char val[16];
+	size_t len;
+
+	(void)memset(&dec, 0, sizeof dec);
+	(void)memset(&sp, 0, sizeof sp);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = lazy_block;
+	dec.blk_len = sizeof lazy_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+	dec.cb = stream_cb;
+	dec.priv = &sp;
+	dec.flg = HPACK_DEC_LZY;
+
+	/* only the first value is decoded lazily */
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_NAME] == 3);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 2);
+	assert(sp.cnt[HPACK_EVT_RAW] == 1);
+	assert(sp.len == 6);
+
+	/* the same block in two partial blocks */
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk_len = 2;
+	dec.cut = 1;
+	CHECK_RES(retval, BLK, hpack_decode, hp, &dec);
+	dec.blk = lazy_block + 2;
+	dec.blk_len = sizeof lazy_block - 2;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 2);
+	assert(sp.cnt[HPACK_EVT_RAW] == 1);
+	assert(sp.len == 6);
+	hpack_free(&hp);
+
+	/* decode it on demand */
+	len = sizeof val;
+	CHECK_RES(retval, OK, hpack_decode_value, sp.val, sp.len, val, &len);
+	assert(len == 8);
+	assert(!strcmp(val, "aaaaaaaa"));
+
+	len = 8;
+	CHECK_RES(retval, BIG, hpack_decode_value, sp.val, sp.len, val, &len);
+	len = sizeof val;
+	CHECK_RES(retval, BUF, hpack_decode_value, sp.val, 5, val, &len);
+	CHECK_RES(retval, ARG, hpack_decode_value, lazy_block + 3, 7, val,
+	    &len);
+	CHECK_RES(retval, HUF, hpack_decode_value, "\x81\x00", 2, val, &len);
+	CHECK_RES(retval, CHR, hpack_decode_value, "\x01\x7f", 2, val, &len);
+	CHECK_RES(retval, ARG, hpack_decode_value, NULL, 2, val, &len);
+
+	/* raw values too */
+	CHECK_RES(retval, OK, hpack_decode_value, "\x01" "5", 2, val, &len);
+	assert(len == 1);
+	assert(!strcmp(val, "5"));
+}
+
+static void
+test_decode_cache(void)
+{
+	struct hpack_decoding dec;
+	struct hpack_field lst[1];
+	size_t cnt;
+	int i;
+
+	hp = make_decoder(0, -1, &static_alloc);
+	CHECK_RES(retval, ARG, hpack_huffman_cache, hp, 512);
+	hpack_free(&hp);
+
+	(void)memset(&dec, 0, sizeof dec);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	CHECK_RES(retval, ARG, hpack_huffman_cache, NULL, 512);
+	CHECK_RES(retval, ARG, hpack_huffman_cache, hp, 128);
+	CHECK_RES(retval, ARG, hpack_huffman_cache, hp, SIZE_MAX);
+	CHECK_RES(retval, OK, hpack_huffman_cache, hp, 256);
+	CHECK_RES(retval, OK, hpack_huffman_cache, hp, 1024);
+	dec.blk = cache_block;
+	dec.blk_len = sizeof cache_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+
+	/* the same value decoded, then found in the cache */
+	for (i = 0; i < 2; i++) {
+		(void)memset(wrk_buf, 0, sizeof wrk_buf);
+		cnt = 1;
+		CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+		assert(cnt == 1);
+		assert(lst[0].val_len == 40);
+		assert(!strcmp(lst[0].val,
+		    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+	}
+
+	/* and again, resuming with the value length */
+	(void)memset(wrk_buf, 0, sizeof wrk_buf);
+	dec.blk_len = 3;
+	dec.cut = 1;
+	cnt = 1;
+	CHECK_RES(retval, BLK, hpack_decode_list, hp, &dec, lst, &cnt);
+	CHECK_RES(retval, BSY, hpack_huffman_cache, hp, 0);
+	dec.blk = cache_block + 3;
+	dec.blk_len = sizeof cache_block - 3;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 1);
+	assert(!strcmp(lst[0].val, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+
+	CHECK_RES(retval, OK, hpack_huffman_cache, hp, 0);
+	hpack_free(&hp);
+}
+
+static void
+test_discard(void)
+{
+	struct hpack_decoding dec;
+	struct hpack_field lst[1];
+	size_t cnt;
+
+	(void)memset(&dec, 0, sizeof dec);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = 9;
+
+	/* only the indexed field needs to fit in the buffer */
+	CHECK_RES(retval, OK, hpack_discard, hp, &dec);
+	CHECK_RES(retval, OK, hpack_discard, hp, &dec);
+
+	/* the same list in two partial blocks */
+	dec.blk_len = 3;
+	dec.cut = 1;
+	CHECK_RES(retval, BLK, hpack_discard, hp, &dec);
+	CHECK_RES(retval, ARG, hpack_decode, hp, &dec);
+	dec.blk = list_block + 3;
+	dec.blk_len = sizeof list_block - 3;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_discard, hp, &dec);
+
+	/* the dynamic table is in sync */
+	dec.blk = dynamic_block;
+	dec.blk_len = sizeof dynamic_block;
+	dec.buf_len = sizeof wrk_buf;
+	cnt = 1;
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 1);
+	assert(lst[0].idx == 62);
+	assert(!strcmp(lst[0].nam, ":path"));
+	assert(!strcmp(lst[0].val, "/a"));
+	hpack_free(&hp);
+
+	/* indexes are still checked */
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	CHECK_RES(retval, IDX, hpack_discard, hp, &dec);
+	hpack_free(&hp);
+}
+
+static void
+test_decode_stream(void)
+{
+	struct hpack_decoding dec;
+	struct stream_priv sp;
+
+	(void)memset(&dec, 0, sizeof dec);
+	(void)memset(&sp, 0, sizeof sp);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = stream_block;
+	dec.blk_len = sizeof stream_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = 16;
+	dec.cb = stream_cb;
+	dec.priv = &sp;
+
+	/* the first value doesn't fit */
+	CHECK_RES(retval, BIG, hpack_decode, hp, &dec);
+	hpack_free(&hp);
+
+	/* the first two values are streamed */
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	(void)memset(&sp, 0, sizeof sp);
+	dec.flg = HPACK_DEC_STM;
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_NAME] == 3);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 3);
+	assert(sp.cnt[HPACK_EVT_DATA] == 2);
+	assert(sp.len == 36);
+	assert(!memcmp(sp.val, "bbbbbbbbbbbbbbbbbbbb", 20));
+	assert(!memcmp(sp.val + 20, "aaaaaaaaaaaaaaaa", 16));
+
+	/* a streamed value spanning two partial blocks */
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk_len = 14;
+	dec.cut = 1;
+	CHECK_RES(retval, BLK, hpack_decode, hp, &dec);
+	dec.blk = stream_block + 14;
+	dec.blk_len = sizeof stream_block - 14;
+	dec.cut = 0;
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_DATA] == 3);
+	assert(sp.len == 36);
+	assert(!memcmp(sp.val, "bbbbbbbbbbbbbbbbbbbb", 20));
+	hpack_free(&hp);
+
+	/* invalid values fail before they are streamed */
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk = inject_raw_block;
+	dec.blk_len = sizeof inject_raw_block;
+	CHECK_RES(retval, CHR, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 1);
+	assert(sp.cnt[HPACK_EVT_DATA] == 0);
+	hpack_free(&hp);
+
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	(void)memset(&sp, 0, sizeof sp);
+	dec.blk = inject_huf_block;
+	dec.blk_len = sizeof inject_huf_block;
+	CHECK_RES(retval, CHR, hpack_decode, hp, &dec);
+	assert(sp.cnt[HPACK_EVT_VALUE] == 1);
+	assert(sp.cnt[HPACK_EVT_DATA] == 0);
+	hpack_free(&hp);
+}
+
+static void
+test_decode_grow(void)
+{
+	struct hpack_decoding dec;
+	struct hpack_field lst[3];
+	size_t cnt;
+
+	(void)memset(&dec, 0, sizeof dec);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = 16;
+	dec.flg = HPACK_DEC_GRW;
+	cnt = 3;
+
+	/* the second field moves to a segment */
+	CHECK_RES(retval, OK, hpack_decode_list, hp, &dec, lst, &cnt);
+	assert(cnt == 3);
+	assert(lst[0].nam == wrk_buf && !strcmp(lst[0].val, "GET"));
+	assert(lst[1].nam != wrk_buf + 12 && !strcmp(lst[1].nam, ":path"));
+	assert(!strcmp(lst[1].val, "/a"));
+	assert(lst[2].nam == lst[1].val + 3 && !strcmp(lst[2].val, "y"));
+
+	/* the same list in two partial blocks */
+	dec.blk_len = 3;
+	dec.cut = 1;
+	CHECK_RES(retval, BLK, hpack_decode_list, hp, &dec, lst, &cnt);
+	dec.blk = list_block + 3;
+	dec.blk_len = sizeof list_block - 3;
+	dec.cut = 0;
+	dec.flg = 0;
+	CHECK_RES(retval, ARG, hpack_decode_list, hp, &dec, lst, &cnt);
+	hpack_free(&hp);
+
+	/* without a free function the buffer can't grow */
+	hp = make_decoder(0, -1, &static_alloc);
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	dec.flg = HPACK_DEC_GRW;
+	cnt = 3;
+	CHECK_RES(retval, SKP, hpack_decode_list, hp, &dec, lst, &cnt);
+	CHECK_RES(retval, OK, hpack_skip, hp);
+	hpack_free(&hp);
+
+	/* a segment allocation failure */
+	once_cnt = 0;
+	hp = make_decoder(0, -1, &once_alloc);
+	cnt = 3;
+	CHECK_RES(retval, OOM, hpack_decode_list, hp, &dec, lst, &cnt);
+	hpack_free(&hp);
+}
+
+static void
+test_ignore_events(void)
+{
+	struct hpack_decoding dec;
+	struct hpack_encoding enc;
+	unsigned cnt[HPACK_EVT_RAW + 1];
+
+	(void)memset(&dec, 0, sizeof dec);
+	(void)memset(cnt, 0, sizeof cnt);
+	hp = make_decoder(512, -1, hpack_default_alloc);
+	dec.blk = list_block;
+	dec.blk_len = sizeof list_block;
+	dec.buf = wrk_buf;
+	dec.buf_len = sizeof wrk_buf;
+	dec.cb = count_cb;
+	dec.priv = cnt;
+	dec.ign = ~(HPACK_MSK_NAME | HPACK_MSK_VALUE);
+
+	CHECK_RES(retval, OK, hpack_decode, hp, &dec);
+	assert(cnt[HPACK_EVT_FIELD] == 0);
+	assert(cnt[HPACK_EVT_NEVER] == 0);
+	assert(cnt[HPACK_EVT_INDEX] == 0);
+	assert(cnt[HPACK_EVT_NAME] == 3);
+	assert(cnt[HPACK_EVT_VALUE] == 3);
+	hpack_free(&hp);
+
+	(void)memset(&enc, 0, sizeof enc);
+	(void)memset(cnt, 0, sizeof cnt);
+	hp = make_encoder(0, -1, hpack_default_alloc);
+	enc.fld = basic_field;
+	enc.fld_cnt = 1;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = count_cb;
+	enc.priv = cnt;
+	enc.ign = HPACK_MSK_FIELD;
+
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	assert(cnt[HPACK_EVT_FIELD] == 0);
+	assert(cnt[HPACK_EVT_DATA] == 1);
+	hpack_free(&hp);
+}
+
 static void
 test_encode_null_args(void)
 {
@@ -547,6 +1162,431 @@ test_search_null_args(void)
 	hpack_free(&hp);
 }
 
+static void
+test_search_static(void)
+{
+	uint16_t idx;
+
+	hp = make_decoder(0, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK,  hpack_search, hp, &idx, ":status", "404");
+	assert(idx == 13);
+	CHECK_RES(retval, NAM, hpack_search, hp, &idx, ":status", "418");
+	assert(idx == 8);
+	CHECK_RES(retval, OK,  hpack_search, hp, &idx, "accept-encoding",
+	    "gzip, deflate");
+	assert(idx == 16);
+	CHECK_RES(retval, OK,  hpack_search, hp, &idx, "www-authenticate", "");
+	assert(idx == 61);
+	CHECK_RES(retval, NAM, hpack_search, hp, &idx, "www-authenticate",
+	    NULL);
+	assert(idx == 61);
+	CHECK_RES(retval, IDX, hpack_search, hp, &idx, "0-unknown", "");
+	CHECK_RES(retval, IDX, hpack_search, hp, &idx, "ages", "");
+	CHECK_RES(retval, IDX, hpack_search, hp, &idx, "", "");
+	hpack_free(&hp);
+}
+
+static void
+test_search_dynamic(void)
+{
+	struct hpack_encoding enc;
+	uint16_t idx;
+
+	/* room for 3 entries */
+	hp = make_encoder(128, -1, hpack_default_alloc);
+
+	(void)memset(&enc, 0, sizeof enc);
+	enc.fld = &fld;
+	enc.fld_cnt = 1;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = noop_cb;
+
+	(void)memset(&fld, 0, sizeof fld);
+	fld.flg = HPACK_FLG_TYP_DYN;
+	fld.nam = "x-foo";
+	fld.val = "abc";
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	CHECK_RES(retval, OK, hpack_search, hp, &idx, "x-foo", "abc");
+	assert(idx == 62);
+
+	fld.val = "def";
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	CHECK_RES(retval, OK, hpack_search, hp, &idx, "x-foo", "abc");
+	assert(idx == 63);
+	CHECK_RES(retval, NAM, hpack_search, hp, &idx, "x-foo", "ghi");
+	assert(idx == 62);
+	CHECK_RES(retval, NAM, hpack_search, hp, &idx, "x-foo", NULL);
+	assert(idx == 62);
+	CHECK_RES(retval, IDX, hpack_search, hp, &idx, "x-bar", "abc");
+
+	/* evict the first entry */
+	fld.nam = "x-bar";
+	fld.val = "abc";
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	fld.nam = "x-baz";
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	CHECK_RES(retval, NAM, hpack_search, hp, &idx, "x-foo", "abc");
+	assert(idx == 64);
+	CHECK_RES(retval, OK, hpack_search, hp, &idx, "x-bar", "abc");
+	assert(idx == 63);
+
+	hpack_free(&hp);
+}
+
+static void
+test_encode_string_lengths(void)
+{
+	struct hpack_encoding enc;
+	const char *nam, *val;
+	static const char hdr[] = "x-foobarbaz";
+
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+
+	(void)memset(&enc, 0, sizeof enc);
+	enc.fld = &fld;
+	enc.fld_cnt = 1;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = noop_cb;
+
+	/* strings don't need to be null-terminated */
+	(void)memset(&fld, 0, sizeof fld);
+	fld.flg = HPACK_FLG_TYP_DYN|HPACK_FLG_VAL_HUF|HPACK_FLG_STR_LEN;
+	fld.nam = hdr;
+	fld.nam_len = 5;
+	fld.val = hdr + 5;
+	fld.val_len = 3;
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	CHECK_RES(retval, OK, hpack_entry, hp, 62, &nam, &val);
+	assert(!strcmp(nam, "x-foo"));
+	assert(!strcmp(val, "bar"));
+
+	/* auto-indexing too */
+	fld.flg = HPACK_FLG_TYP_LIT|HPACK_FLG_AUT_IDX|HPACK_FLG_STR_LEN;
+	fld.nam = "accept-encodings";
+	fld.nam_len = 15;
+	fld.val = "gzip, deflate, br";
+	fld.val_len = 13;
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	assert(fld.flg & HPACK_FLG_TYP_IDX);
+	assert(fld.idx == 16);
+	CHECK_RES(retval, OK, hpack_clean_field, &fld);
+
+	hpack_free(&hp);
+}
+
+struct preset_priv {
+	char	buf[64];
+	size_t	len;
+};
+
+static void
+preset_cb(enum hpack_event_e evt, const char *buf, size_t len, void *priv)
+{
+	struct preset_priv *pp;
+
+	if (evt != HPACK_EVT_DATA)
+		return;
+
+	pp = priv;
+	assert(pp->len + len <= sizeof pp->buf);
+	(void)memcpy(pp->buf + pp->len, buf, len);
+	pp->len += len;
+}
+
+static void
+test_encode_preset(void)
+{
+	struct hpack_encoding enc;
+	struct hpack_field lst[3];
+	struct hpack_preset *pst;
+	struct preset_priv ref, out;
+	int i;
+	static const char * const val[] = {
+		"gzip, deflate, br", "x", "gzip, deflate, br",
+	};
+	static const char * const bad[] = { "no-cache", "" };
+
+	assert(hpack_preset(NULL, 1, hpack_default_alloc) == NULL);
+	assert(hpack_preset(val, 0, hpack_default_alloc) == NULL);
+	assert(hpack_preset(val, 1, NULL) == NULL);
+	assert(hpack_preset(bad, 2, hpack_default_alloc) == NULL);
+	hpack_preset_free(NULL);
+
+	pst = hpack_preset(val, 3, hpack_default_alloc);
+	assert(pst != NULL);
+
+	(void)memset(lst, 0, sizeof lst);
+	lst[0].flg = HPACK_FLG_TYP_LIT|HPACK_FLG_NAM_IDX|HPACK_FLG_VAL_AUT;
+	lst[0].nam_idx = 16;
+	lst[0].val = "gzip, deflate, br";
+	lst[1].flg = HPACK_FLG_TYP_LIT|HPACK_FLG_NAM_IDX|HPACK_FLG_VAL_AUT;
+	lst[1].nam_idx = 16;
+	lst[1].val = "x";
+	lst[2].flg = HPACK_FLG_TYP_LIT|HPACK_FLG_NAM_IDX|HPACK_FLG_VAL_HUF;
+	lst[2].nam_idx = 16;
+	lst[2].val = "x";
+
+	(void)memset(&enc, 0, sizeof enc);
+	enc.fld = lst;
+	enc.fld_cnt = 3;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = preset_cb;
+
+	/* the same block with or without a preset */
+	(void)memset(&ref, 0, sizeof ref);
+	enc.priv = &ref;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	(void)memset(&out, 0, sizeof out);
+	enc.priv = &out;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	enc.pst = (const void *)&enc;
+	CHECK_RES(retval, ARG, hpack_encode, hp, &enc);
+	enc.pst = pst;
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	assert(ref.len == out.len);
+	assert(!memcmp(ref.buf, out.buf, ref.len));
+
+	/* plain literals use the preset too */
+	for (i = 0; i < 3; i++)
+		lst[i].flg &= ~(HPACK_FLG_VAL_HUF|HPACK_FLG_VAL_AUT);
+
+	(void)memset(&ref, 0, sizeof ref);
+	enc.priv = &ref;
+	enc.pst = NULL;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	(void)memset(&out, 0, sizeof out);
+	enc.priv = &out;
+	enc.pst = pst;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	assert(ref.len == out.len);
+	assert(!memcmp(ref.buf, out.buf, ref.len));
+
+	hpack_preset_free(&pst);
+	assert(pst == NULL);
+}
+
+static void
+test_encode_precoded(void)
+{
+	struct hpack_encoding enc;
+	struct hpack_field lst[3];
+	struct preset_priv ref, out;
+	const char *nam, *val;
+	char pre[3][48];
+	size_t len;
+	int i;
+
+	len = sizeof pre[0];
+	CHECK_RES(retval, ARG, hpack_precode_value, NULL, 0, 0, pre[0], &len);
+	CHECK_RES(retval, ARG, hpack_precode_value, "x", 1, 0, NULL, &len);
+	CHECK_RES(retval, ARG, hpack_precode_value, "x", 1, 0, pre[0], NULL);
+	CHECK_RES(retval, ARG, hpack_precode_value, "x", 1,
+	    HPACK_FLG_TYP_LIT, pre[0], &len);
+	CHECK_RES(retval, CHR, hpack_precode_value, "\n", 1, 0, pre[0], &len);
+	len = 4;
+	CHECK_RES(retval, BIG, hpack_precode_value, "gzip, deflate, br", 17,
+	    HPACK_FLG_VAL_AUT, pre[0], &len);
+
+	(void)memset(lst, 0, sizeof lst);
+	lst[0].flg = HPACK_FLG_TYP_DYN|HPACK_FLG_NAM_IDX|HPACK_FLG_VAL_AUT;
+	lst[0].nam_idx = 16;
+	lst[0].val = "gzip, deflate, br";
+	lst[1].flg = HPACK_FLG_TYP_LIT|HPACK_FLG_NAM_IDX|HPACK_FLG_VAL_HUF;
+	lst[1].nam_idx = 16;
+	lst[1].val = "x";
+	lst[2].flg = HPACK_FLG_TYP_NVR|HPACK_FLG_NAM_IDX;
+	lst[2].nam_idx = 16;
+	lst[2].val = "identity";
+
+	(void)memset(&enc, 0, sizeof enc);
+	enc.fld = lst;
+	enc.fld_cnt = 3;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = preset_cb;
+
+	(void)memset(&ref, 0, sizeof ref);
+	enc.priv = &ref;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	/* the same block with pre-encoded values */
+	for (i = 0; i < 3; i++) {
+		len = sizeof pre[i];
+		CHECK_RES(retval, OK, hpack_precode_value, lst[i].val,
+		    strlen(lst[i].val),
+		    lst[i].flg & (HPACK_FLG_VAL_HUF|HPACK_FLG_VAL_AUT),
+		    pre[i], &len);
+		assert(!strcmp(pre[i], lst[i].val));
+		assert(len > strlen(lst[i].val) + 1);
+		lst[i].flg |= HPACK_FLG_VAL_PRE;
+		lst[i].val = pre[i];
+	}
+
+	(void)memset(&out, 0, sizeof out);
+	enc.priv = &out;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+
+	assert(ref.len == out.len);
+	assert(!memcmp(ref.buf, out.buf, ref.len));
+
+	/* the plain value is inserted in the dynamic table */
+	CHECK_RES(retval, OK, hpack_entry, hp, 62, &nam, &val);
+	assert(!strcmp(nam, "accept-encoding"));
+	assert(!strcmp(val, "gzip, deflate, br"));
+	hpack_free(&hp);
+
+	/* a wrong length or a foreign buffer */
+	enc.fld = &lst[1];
+	enc.fld_cnt = 1;
+	lst[1].flg |= HPACK_FLG_STR_LEN;
+	lst[1].val_len = 0;
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, ARG, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	lst[1].flg &= ~HPACK_FLG_STR_LEN;
+	lst[1].val_len = 0;
+	pre[1][2] = 'y';
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, ARG, hpack_encode, hp, &enc);
+	hpack_free(&hp);
+
+	CHECK_RES(retval, OK, hpack_clean_field, &lst[1]);
+	assert(lst[1].flg == 0);
+}
+
+static void
+test_encode_template(void)
+{
+	struct hpack_encoding enc;
+	struct hpack_field lst[3], fld2;
+	struct hpack_template *tpl, *lit;
+	struct preset_priv out;
+	char srv[] = "cashpack";
+	static const uint8_t cur_blk[] = { 0x88, 0xbf, 0xbe };
+	static const uint8_t old_blk[] = { 0x88, 0xc0, 0xbf };
+	int i;
+
+	(void)memset(lst, 0, sizeof lst);
+	lst[0].flg = HPACK_FLG_TYP_DYN|HPACK_FLG_AUT_IDX;
+	lst[0].nam = ":status";
+	lst[0].val = "200";
+	lst[1].flg = HPACK_FLG_TYP_DYN|HPACK_FLG_AUT_IDX;
+	lst[1].nam = "server";
+	lst[1].val = srv;
+	lst[2].flg = HPACK_FLG_TYP_DYN|HPACK_FLG_AUT_IDX;
+	lst[2].nam = "cache-control";
+	lst[2].val = "no-store";
+
+	hp = make_encoder(0, -1, &static_alloc);
+	CHECK_RES(retval, ARG, hpack_template, hp, lst, 3, &tpl);
+	hpack_free(&hp);
+
+	hp = make_decoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, ARG, hpack_template, hp, lst, 3, &tpl);
+	hpack_free(&hp);
+
+	hp = make_encoder(4096, -1, hpack_default_alloc);
+	CHECK_RES(retval, ARG, hpack_template, NULL, lst, 3, &tpl);
+	CHECK_RES(retval, ARG, hpack_template, hp, NULL, 3, &tpl);
+	CHECK_RES(retval, ARG, hpack_template, hp, lst, 0, &tpl);
+	CHECK_RES(retval, ARG, hpack_template, hp, lst, 3, NULL);
+
+	(void)memset(&enc, 0, sizeof enc);
+	enc.fld = lst;
+	enc.fld_cnt = 3;
+	enc.buf = wrk_buf;
+	enc.buf_len = sizeof wrk_buf;
+	enc.cb = preset_cb;
+	enc.priv = &out;
+
+	/* nothing to reference yet, and nothing inserted */
+	CHECK_RES(retval, OK, hpack_template, hp, lst, 3, &lit);
+	CHECK_RES(retval, ARG, hpack_encode_template, hp, NULL, &enc);
+	CHECK_RES(retval, ARG, hpack_encode_template, NULL, lit, &enc);
+
+	/* the fallback populates the dynamic table */
+	(void)memset(&out, 0, sizeof out);
+	CHECK_RES(retval, OK, hpack_encode_template, hp, lit, &enc);
+	assert(out.len > sizeof cur_blk);
+	assert(out.buf[0] == (char)0x88);
+
+	/* and the template is compiled again against it */
+	for (i = 0; i < 2; i++) {
+		(void)memset(&out, 0, sizeof out);
+		CHECK_RES(retval, OK, hpack_encode_template, hp, lit, &enc);
+		assert(out.len == sizeof cur_blk);
+		assert(!memcmp(out.buf, cur_blk, sizeof cur_blk));
+	}
+
+	/* the template references the new entries */
+	CHECK_RES(retval, OK, hpack_template, hp, lst, 3, &tpl);
+	(void)memset(srv, 0, sizeof srv);
+
+	(void)memset(&out, 0, sizeof out);
+	CHECK_RES(retval, OK, hpack_encode_template, hp, tpl, &enc);
+	assert(out.len == sizeof cur_blk);
+	assert(!memcmp(out.buf, cur_blk, sizeof cur_blk));
+
+	/* a new insertion shifts the indexes */
+	(void)memset(&fld2, 0, sizeof fld2);
+	fld2.flg = HPACK_FLG_TYP_DYN;
+	fld2.nam = "x-foo";
+	fld2.val = "bar";
+	enc.fld = &fld2;
+	enc.fld_cnt = 1;
+	CHECK_RES(retval, OK, hpack_encode, hp, &enc);
+
+	for (i = 0; i < 2; i++) {
+		(void)memset(&out, 0, sizeof out);
+		CHECK_RES(retval, OK, hpack_encode_template, hp, tpl, &enc);
+		assert(out.len == sizeof old_blk);
+		assert(!memcmp(out.buf, old_blk, sizeof old_blk));
+	}
+
+	hpack_template_free(NULL);
+	hpack_template_free(&tpl);
+	assert(tpl == NULL);
+	hpack_template_free(&tpl);
+	hpack_template_free(&lit);
+	hpack_free(&hp);
+
+	/* a field larger than the table never becomes current */
+	hp = make_encoder(64, -1, hpack_default_alloc);
+	lst[1].val = "a value too large for the dynamic table of 64 octets";
+	CHECK_RES(retval, OK, hpack_template, hp, lst + 1, 1, &lit);
+
+	enc.fld = lst + 1;
+	enc.fld_cnt = 1;
+	for (i = 0; i < 3; i++) {
+		(void)memset(&out, 0, sizeof out);
+		CHECK_RES(retval, OK, hpack_encode_template, hp, lit, &enc);
+		assert(out.len > 2);
+		assert(out.buf[0] == (char)0x76); /* inserted, "server" */
+		assert(out.buf[1] == (char)0x34);
+	}
+
+	hpack_template_free(&lit);
+	hpack_free(&hp);
+}
+
 static void
 test_use_defunct_decoder(void)
 {
@@ -882,6 +1922,14 @@ main(void)
 	test_index_invalid_entry();
 	test_decode_null_args();
 	test_decode_fields_null_args();
+	test_decode_list();
+	test_decode_grow();
+	test_decode_stream();
+	test_discard();
+	test_decode_select();
+	test_decode_lazy();
+	test_decode_cache();
+	test_ignore_events();
 	test_encode_null_args();
 
 	test_resize_overflow();
@@ -894,6 +1942,12 @@ main(void)
 	test_skip_null_decoder();
 
 	test_search_null_args();
+	test_search_static();
+	test_search_dynamic();
+	test_encode_string_lengths();
+	test_encode_preset();
+	test_encode_precoded();
+	test_encode_template();
 
 	test_use_defunct_decoder();
 	test_use_busy_decoder();
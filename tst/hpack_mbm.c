@@ -46,14 +46,15 @@
 		abort();	\
 	} while (0)
 
-#define FIELD_MARKER { 0, 0, 0, NULL, NULL }
-#define FIELD_ENTRY(n, v) { HPACK_FLG_TYP_DYN|HPACK_FLG_AUT_IDX, 0, 0, n, v }
+#define FIELD_MARKER { 0, 0, 0, NULL, NULL, 0, 0 }
+#define FIELD_ENTRY(n, v) \
+	{ HPACK_FLG_TYP_DYN|HPACK_FLG_AUT_IDX, 0, 0, n, v, 0, 0 }
 #define FIELD_LOOP(it, tbl) for (it = tbl; it->nam != NULL; it++)
 
 static struct hpack *hp;
 
 static struct hpack_field static_entries[] = {
-#define HPS(i, n, v) { 0, 0, 0, n, v },
+#define HPS(i, n, v) { 0, 0, 0, n, v, 0, 0 },
 #include "tbl/hpack_static.h"
 #undef HPS
 	FIELD_MARKER
@@ -132,6 +133,8 @@ mbm_setup(void)
 	he.buf_len = sizeof buf;
 	he.cb = mbm_noop_cb;
 	he.priv = NULL;
+	he.ign = 0;
+	he.pst = NULL;
 	he.cut = 0;
 	FIELD_LOOP(hf, dynamic_entries)
 		he.fld_cnt++;